@@ -1,23 +1,77 @@
 from m5.params import *
 from m5.proxy import *
 from m5.objects.ClockedObject import ClockedObject
+from m5.util.pybind import PyBindMethod
+
+class DbrcReplacementPolicy(Enum):
+    vals = ['Clock', 'SRRIP', 'BRRIP', 'TreePLRU', 'LevelAware']
+
+class DbrcArbitration(Enum):
+    vals = ['PortRoundRobin', 'WeightedQoS']
 
 class DbrcCache(ClockedObject):
     type = 'DbrcCache'
     cxx_header = "learning_gem5/mine/dbrc_cache.hh"
 
+    # Pin and unpin address ranges at run time, e.g. between two calls to
+    # m5.simulate()
+    cxx_exports = [
+        PyBindMethod("lockRange"),
+        PyBindMethod("unlockRange"),
+    ]
+
     # Vector port example. Both the instruction and data ports connect to this
     # port which is automatically split out into two ports.
     cpu_side = VectorResponsePort("CPU side port, receives requests")
     mem_side = RequestPort("Memory side port, sends requests")
 
-    latency = Param.Cycles(1, "Cycles taken on a hit or to resolve a miss")
+    per_level_latency = Param.Cycles(1, "Cycles taken to read one table "
+                                        "when walking the tree")
+    data_latency = Param.Cycles(1, "Cycles taken to access a data block")
 
     size = Param.MemorySize('16kB', "The size of the cache")
+    num_banks = Param.Unsigned(1, "Number of banks, consecutive blocks go "
+                                  "to different banks")
 
     system = Param.System(Parent.any, "The system this cache is part of")
 
     num_BTH = Param.Unsigned(3, "The number of BTH tables used")
-    target_BTH = Param.Unsigned(3, "Target BTH for TLB")
+    target_BTH = Param.Unsigned(3, "Shallowest BTH level whose tables are "
+                                "cached in the TLB, num_BTH for data only")
     TLB_size = Param.Unsigned(65536, "Entries in TLB")
+    TLB_assoc = Param.Unsigned(8, "Associativity of the TLB, TLB_size / "
+                                  "TLB_assoc sets (a power of two)")
+    tlb_latency = Param.Cycles(1, "Cycles taken to look up the TLB")
     MNA = Param.Unsigned(5, "Maximum number of attempts for replacement algorithm")
+    replacement_policy = Param.DbrcReplacementPolicy('Clock',
+        "Policy selecting the DBA entries to replace: the VBIR clock, "
+        "SRRIP, BRRIP, tree PLRU or the clock protecting upper tables")
+
+    locked_ranges = VectorParam.AddrRange([], "Address ranges whose blocks, "
+        "and the tables on their path, are never replaced once installed")
+    max_locked_fraction = Param.Float(0.5, "Largest fraction of the DBA "
+        "entries of a bank that can be locked")
+
+    prefetch_degree = Param.Unsigned(0, "Blocks fetched ahead of the stride "
+                                        "stream of each requestor, 0 "
+                                        "disables the prefetcher")
+    prefetch_paths = Param.Bool(True, "Build the tables of the next L0T "
+                                      "region ahead of a stream")
+
+    port_queue_size = Param.Unsigned(4, "Timing requests each CPU side "
+                                        "port can queue")
+    arbitration = Param.DbrcArbitration('PortRoundRobin',
+        "How the queued requests of the CPU side ports are granted: one "
+        "per port in turn, or as many per turn as the weight of the "
+        "requestor")
+    requestor_weights = VectorParam.Unsigned([], "Grants per turn of each "
+        "requestor ID under WeightedQoS, requestors past the end weigh 1")
+
+    trace_file = Param.String("", "Binary trace of every access to the "
+        "cache, in the output directory, gzipped if the name ends in .gz. "
+        "Empty for none")
+
+    mshrs = Param.Unsigned(4, "Number of MSHRs (max outstanding requests)")
+    tgts_per_mshr = Param.Unsigned(20, "Max number of accesses per MSHR")
+    write_buffers = Param.Unsigned(8, "Number of write buffers, must be at "
+                                      "least num_BTH")
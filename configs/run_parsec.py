@@ -69,6 +69,11 @@ def writeBenchScript(dir, bench, size, num_cpus):
     return file_name
 
 if __name__ == "__m5_main__":
+    SimpleOpts.add_option("--dbrc", action="store_true",
+                          help="Use one DBRC as the L2 shared by all CPUs")
+    SimpleOpts.add_option("--dbrc-trace", default="",
+                          help="Record the accesses to the DBRC in this "
+                               "binary trace, in the output directory")
     (opts, args) = SimpleOpts.parse_args()
     kernel, disk, cpu, benchmark, size, num_cpus = args
 
@@ -76,7 +81,12 @@ if __name__ == "__m5_main__":
         m5.fatal("cpu not supported")
 
     # create the system
-    system = MySystem(kernel, disk, cpu, int(num_cpus), True)
+    system = MySystem(kernel, disk, cpu, int(num_cpus), True,
+                      dbrc = opts.dbrc)
+    if opts.dbrc_trace:
+        if not opts.dbrc:
+            m5.fatal("--dbrc-trace needs --dbrc")
+        system.l2cache.trace_file = opts.dbrc_trace
 
     # Exit from guest on workbegin/workend
     system.exit_on_work_items = True
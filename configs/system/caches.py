@@ -148,11 +148,15 @@ class DbrcL2Cache(DbrcCache):
 
     # Default parameters
     size = '1MB'
-    latency = 1
+    num_banks = 4
+    per_level_latency = 1
+    data_latency = 1
     num_BTH = 3
     TLB_size = 65536
     MNA = 5
     target_BTH = 3
+    mshrs = 20
+    tgts_per_mshr = 12
 
     def __init__(self):
         super(DbrcCache, self).__init__()
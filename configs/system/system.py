@@ -32,10 +32,12 @@ from .caches import *
 
 class MySystem(System):
 
-    def __init__(self, kernel, disk, cpu_type, num_cpus, no_kvm = False):
+    def __init__(self, kernel, disk, cpu_type, num_cpus, no_kvm = False,
+                 dbrc = False):
         super(MySystem, self).__init__()
 
         self._no_kvm = no_kvm
+        self._dbrc = dbrc
         self._host_parallel = cpu_type == "kvm"
 
         # Set up the clock domain and the voltage domain
@@ -143,9 +145,19 @@ class MySystem(System):
         self.pc.south_bridge.ide.disks = [disk0, disk2]
 
     def createCacheHierarchy(self):
+        if self._dbrc:
+            # One DBRC L2 shared by all CPUs, it keeps the L1s coherent
+            # through the l2bus and takes snoops from the membus
+            self.l2bus = L2XBar()
+            self.l2cache = DbrcL2Cache()
+            self.l2cache.connectCPUSideBus(self.l2bus)
+            self.l2cache.connectMemSideBus(self.membus)
+
         for cpu in self.cpu:
             # Create a memory bus, a coherent crossbar, in this case
-            cpu.l2bus = L2XBar()
+            l2bus = self.l2bus if self._dbrc else L2XBar()
+            if not self._dbrc:
+                cpu.l2bus = l2bus
 
             # Create an L1 instruction and data cache
             cpu.icache = L1ICache()
@@ -158,9 +170,12 @@ class MySystem(System):
             cpu.mmucache.connectCPU(cpu)
 
             # Hook the CPU ports up to the l2bus
-            cpu.icache.connectBus(cpu.l2bus)
-            cpu.dcache.connectBus(cpu.l2bus)
-            cpu.mmucache.connectBus(cpu.l2bus)
+            cpu.icache.connectBus(l2bus)
+            cpu.dcache.connectBus(l2bus)
+            cpu.mmucache.connectBus(l2bus)
+
+            if self._dbrc:
+                continue
 
             # Create an L2 cache and connect it to the l2bus
             cpu.l2cache = L2Cache()
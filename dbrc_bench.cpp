@@ -0,0 +1,392 @@
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dbrc_core.hh"
+
+typedef uint64_t Addr;
+
+/// Allocations made since the start, counted by the operator new below
+static uint64_t allocations = 0;
+
+void *
+operator new(size_t size)
+{
+    allocations++;
+    if (void *p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void
+operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+double
+nanoseconds(Clock::time_point start, Clock::time_point end)
+{
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+/// The cost of reading the clock, taken out of the fills timed one by one
+double
+clockOverhead()
+{
+    const unsigned reads = 1 << 16;
+    Clock::time_point start = Clock::now();
+    for (unsigned i = 0; i < reads; i++)
+        Clock::now();
+    return nanoseconds(start, Clock::now()) / reads;
+}
+
+/// A DBRC shape to measure
+struct Geometry
+{
+    uint64_t size;
+    unsigned num_BTH;
+    unsigned TLB_size;
+};
+
+/// What a pattern cost on a geometry
+struct Result
+{
+    Geometry geometry;
+    std::string pattern;
+    uint64_t accesses;
+    double hitRatio;
+    double tlbHitRatio;
+    double nsPerSearch;
+    double nsPerLookup;
+    double nsPerFill;
+    double allocsPerLookup;
+    double allocsPerFill;
+};
+
+const unsigned blockSize = 64;
+const unsigned TLB_assoc = 8;
+const unsigned MNA = 5;
+
+DbrcCore::Config
+coreConfig(const Geometry &geometry, unsigned TLB_size)
+{
+    DbrcCore::Config config;
+    config.blockSize = blockSize;
+    config.capacity = geometry.size / blockSize;
+    config.numBanks = 1;
+    config.numBTH = geometry.num_BTH;
+    config.targetBTH = geometry.num_BTH;
+    config.tlbSize = TLB_size;
+    config.tlbAssoc = TLB_assoc;
+    config.mna = MNA;
+    config.policy = DbrcCore::Clock;
+    config.maxLockedPerBank = 0;
+    return config;
+}
+
+/**
+ * @brief Block addresses of the synthetic access patterns. Patterns over a
+ * footprint larger than the cache keep it filling, the hot sets probe the
+ * B-TLB with a working set that fits in it and one that overflows it.
+ */
+std::vector<Addr>
+generate(const std::string &pattern, const Geometry &geometry,
+         uint64_t accesses)
+{
+    std::mt19937_64 rng(1);
+    uint64_t capacity = geometry.size / blockSize;
+    uint64_t footprint = 4 * capacity;
+    std::vector<Addr> blocks;
+    blocks.reserve(accesses);
+
+    if (pattern == "sequential") {
+        for (uint64_t i = 0; i < accesses; i++)
+            blocks.push_back(i % footprint);
+    } else if (pattern == "strided") {
+        // A page and a block apart, so that blocks spread over the regions
+        const uint64_t stride = 4096 / blockSize + 1;
+        for (uint64_t i = 0; i < accesses; i++)
+            blocks.push_back(i * stride % (footprint * stride));
+    } else if (pattern == "uniform") {
+        std::uniform_int_distribution<uint64_t> block(0, footprint - 1);
+        for (uint64_t i = 0; i < accesses; i++)
+            blocks.push_back(block(rng));
+    } else if (pattern == "zipfian") {
+        // Rank r is drawn with a probability in 1 / r^0.99, the ranks are
+        // scattered over the footprint
+        std::vector<double> cdf(footprint);
+        double sum = 0;
+        for (uint64_t r = 0; r < footprint; r++)
+            cdf[r] = sum += 1 / std::pow(r + 1, 0.99);
+        std::uniform_real_distribution<double> draw(0, sum);
+        for (uint64_t i = 0; i < accesses; i++) {
+            uint64_t rank = std::lower_bound(cdf.begin(), cdf.end(),
+                                             draw(rng)) - cdf.begin();
+            blocks.push_back(rank * 0x9e3779b97f4a7c15ULL % footprint);
+        }
+    } else if (pattern == "hot-fit-tlb" || pattern == "hot-overflow-tlb") {
+        uint64_t hot = pattern == "hot-fit-tlb" ?
+            std::max<uint64_t>(1, geometry.TLB_size / 2) :
+            std::min<uint64_t>(capacity / 2, 8 * geometry.TLB_size);
+        std::uniform_int_distribution<uint64_t> block(0, hot - 1);
+        for (uint64_t i = 0; i < accesses; i++)
+            blocks.push_back(block(rng));
+    } else {
+        throw std::runtime_error("Unknown pattern " + pattern);
+    }
+
+    for (auto &block : blocks)
+        block *= blockSize;
+    return blocks;
+}
+
+/**
+ * @brief Replay a pattern, inserting the blocks that miss, and time each
+ * insert.
+ *
+ * @return nanoseconds spent in inserts, the clock overhead taken out
+ */
+double
+fill(DbrcCore &core, const std::vector<Addr> &blocks, double overhead,
+     uint64_t &fills)
+{
+    std::vector<uint8_t> data(blockSize, 0);
+    double ns = 0;
+    fills = 0;
+    for (Addr block_addr : blocks) {
+        if (core.lookup(block_addr).found)
+            continue;
+        uint32_t index;
+        Clock::time_point start = Clock::now();
+        core.insert(block_addr, data.data(), false, index);
+        ns += nanoseconds(start, Clock::now()) - overhead;
+        fills++;
+    }
+    return ns;
+}
+
+Result
+measure(const Geometry &geometry, const std::string &pattern,
+        uint64_t accesses, double overhead)
+{
+    std::vector<Addr> blocks = generate(pattern, geometry, accesses);
+    DbrcCore core(coreConfig(geometry, geometry.TLB_size));
+    // Without a TLB every lookup walks the tree. The walks update the
+    // replacement state, so its contents drift a little from those of core.
+    DbrcCore walker(coreConfig(geometry, 0));
+    Result result = {geometry, pattern, accesses, 0, 0, 0, 0, 0, 0, 0};
+
+    // Fill the cache with blocks far from the pattern, so that every fill
+    // of the pattern replaces a valid entry
+    std::vector<Addr> warm_up(geometry.size / blockSize);
+    for (size_t i = 0; i < warm_up.size(); i++)
+        warm_up[i] = (Addr(1) << 40) + i * blockSize;
+    uint64_t fills;
+    fill(core, warm_up, overhead, fills);
+    fill(walker, warm_up, overhead, fills);
+
+    uint64_t allocs = allocations;
+    double ns = fill(core, blocks, overhead, fills);
+    if (fills) {
+        result.nsPerFill = ns / fills;
+        result.allocsPerFill = double(allocations - allocs) / fills;
+    }
+    fill(walker, blocks, overhead, fills);
+
+    // Lookups only, the contents stay the same
+    uint64_t hits = 0, tlb_hits = 0;
+    allocs = allocations;
+    Clock::time_point start = Clock::now();
+    for (Addr block_addr : blocks) {
+        DbrcCore::Lookup found = core.lookup(block_addr);
+        hits += found.found;
+        tlb_hits += found.tlbHit;
+    }
+    result.nsPerLookup = nanoseconds(start, Clock::now()) / accesses;
+    result.allocsPerLookup = double(allocations - allocs) / accesses;
+    result.hitRatio = double(hits) / accesses;
+    result.tlbHitRatio = double(tlb_hits) / accesses;
+
+    start = Clock::now();
+    for (Addr block_addr : blocks)
+        hits += walker.lookup(block_addr).found;
+    result.nsPerSearch = nanoseconds(start, Clock::now()) / accesses;
+
+    return result;
+}
+
+std::vector<uint64_t>
+parseList(const std::string &text)
+{
+    std::vector<uint64_t> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        char *suffix;
+        uint64_t value = strtoull(item.c_str(), &suffix, 0);
+        std::string unit(suffix);
+        if (suffix == item.c_str() ||
+            (unit != "" && unit != "kB" && unit != "MB"))
+            throw std::runtime_error("Bad value '" + item + "'");
+        values.push_back(value << (unit == "kB" ? 10 : unit == "MB" ? 20 : 0));
+    }
+    return values;
+}
+
+void
+writeCSV(std::ostream &out, const std::string &label,
+         const std::vector<Result> &results)
+{
+    out << "label,size,num_BTH,TLB_size,pattern,accesses,hit_ratio,"
+           "tlb_hit_ratio,ns_per_search,ns_per_lookup,ns_per_fill,"
+           "allocs_per_lookup,allocs_per_fill" << std::endl;
+    for (const auto &r : results) {
+        out << label << "," << r.geometry.size << "," << r.geometry.num_BTH
+            << "," << r.geometry.TLB_size << "," << r.pattern << ","
+            << r.accesses << "," << r.hitRatio << "," << r.tlbHitRatio << ","
+            << r.nsPerSearch << "," << r.nsPerLookup << "," << r.nsPerFill
+            << "," << r.allocsPerLookup << "," << r.allocsPerFill
+            << std::endl;
+    }
+}
+
+void
+writeJSON(std::ostream &out, const std::string &label,
+          const std::vector<Result> &results)
+{
+    out << "[" << std::endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        out << "  {\"label\": \"" << label << "\""
+            << ", \"size\": " << r.geometry.size
+            << ", \"num_BTH\": " << r.geometry.num_BTH
+            << ", \"TLB_size\": " << r.geometry.TLB_size
+            << ", \"pattern\": \"" << r.pattern << "\""
+            << ", \"accesses\": " << r.accesses
+            << ", \"hit_ratio\": " << r.hitRatio
+            << ", \"tlb_hit_ratio\": " << r.tlbHitRatio
+            << ", \"ns_per_search\": " << r.nsPerSearch
+            << ", \"ns_per_lookup\": " << r.nsPerLookup
+            << ", \"ns_per_fill\": " << r.nsPerFill
+            << ", \"allocs_per_lookup\": " << r.allocsPerLookup
+            << ", \"allocs_per_fill\": " << r.allocsPerFill << "}"
+            << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "]" << std::endl;
+}
+
+/**
+ * @brief Measures the host cost of the DBRC hot paths on synthetic access
+ * patterns: the tree walk of CacheSearch (lookups with no TLB), lookups
+ * through the B-TLB, and fills, which include the victim scan and the
+ * evictions. Allocations are counted for lookups and fills.
+ *
+ * @details
+ *      Results are written as CSV, or JSON for an output file ending in
+ *      .json, one row per geometry and pattern. A label, e.g. the commit,
+ *      tells the runs to compare apart.
+ */
+int main(int argc, char **argv)
+{
+    std::vector<uint64_t> sizes = {1 << 20, 16 << 20}, num_BTHs = {2, 3, 4};
+    std::vector<uint64_t> TLB_sizes = {4096};
+    uint64_t accesses = 1 << 20;
+    std::string label, output;
+    std::vector<std::string> patterns = {
+        "sequential", "strided", "uniform", "zipfian", "hot-fit-tlb",
+        "hot-overflow-tlb"
+    };
+
+    try {
+        for (int i = 1; i < argc; i += 2) {
+            std::string arg = argv[i];
+            if (i + 1 == argc)
+                throw std::runtime_error("No value for " + arg);
+            std::string value = argv[i + 1];
+            if (arg == "--size")
+                sizes = parseList(value);
+            else if (arg == "--num-bth")
+                num_BTHs = parseList(value);
+            else if (arg == "--tlb-size")
+                TLB_sizes = parseList(value);
+            else if (arg == "--accesses")
+                accesses = parseList(value).at(0);
+            else if (arg == "--label")
+                label = value;
+            else if (arg == "--output")
+                output = value;
+            else
+                throw std::runtime_error("Unknown option " + arg);
+        }
+        if (accesses == 0)
+            throw std::runtime_error("No accesses");
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl
+                  << "Usage: " << argv[0] << " [--size LIST] [--num-bth LIST]"
+                  << " [--tlb-size LIST] [--accesses N] [--label TEXT]"
+                  << " [--output FILE]" << std::endl;
+        return 1;
+    }
+
+    double overhead = clockOverhead();
+    std::vector<Result> results;
+    for (uint64_t size : sizes)
+    for (uint64_t num_BTH : num_BTHs)
+    for (uint64_t TLB_size : TLB_sizes)
+    {
+        Geometry geometry = {size, unsigned(num_BTH), unsigned(TLB_size)};
+        if (size / blockSize < 2 * num_BTH || num_BTH == 0 ||
+            DbrcGeometry(blockSize, num_BTH).regionShift() >= 64 ||
+            TLB_size % TLB_assoc != 0 ||
+            ((TLB_size / TLB_assoc) & (TLB_size / TLB_assoc - 1))) {
+            std::cerr << "Skipping size " << size << ", num_BTH " << num_BTH
+                      << ", TLB_size " << TLB_size << std::endl;
+            continue;
+        }
+        for (const auto &pattern : patterns) {
+            results.push_back(measure(geometry, pattern, accesses, overhead));
+            const Result &r = results.back();
+            fprintf(stderr, "%8lukB %u BTH %6u TLB %-16s search %6.1fns "
+                    "lookup %6.1fns fill %7.1fns\n", size >> 10,
+                    r.geometry.num_BTH, r.geometry.TLB_size, pattern.c_str(),
+                    r.nsPerSearch, r.nsPerLookup, r.nsPerFill);
+        }
+    }
+
+    if (output.empty()) {
+        writeCSV(std::cout, label, results);
+        return 0;
+    }
+    std::ofstream out(output);
+    if (!out) {
+        std::cerr << "Can't create '" << output << "'" << std::endl;
+        return 1;
+    }
+    if (output.size() > 5 &&
+        output.compare(output.size() - 5, 5, ".json") == 0)
+        writeJSON(out, label, results);
+    else
+        writeCSV(out, label, results);
+    return 0;
+}
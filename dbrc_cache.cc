@@ -1,31 +1,152 @@
 #include "learning_gem5/mine/dbrc_cache.hh"
 
+#include <zlib.h>
+
+#include "base/intmath.hh"
+#include "base/output.hh"
 #include "base/random.hh"
 #include "debug/DbrcCache.hh"
+#include "sim/core.hh"
+#include "sim/stats.hh"
 #include "sim/system.hh"
 
-static uint32_t pow(uint32_t x, uint32_t e)
+/// Write a buffer to a checkpoint file, fatal if that fails
+static void
+gzWriteAll(gzFile file, const void *buf, size_t len,
+           const std::string &filename)
 {
-    uint32_t y = x;
-    for (size_t i = 1; i < e; i++)
-    {
-        y *= x;
+    const uint8_t *ptr = static_cast<const uint8_t *>(buf);
+    while (len > 0) {
+        unsigned chunk = std::min<size_t>(len, 1 << 30);
+        if (gzwrite(file, ptr, chunk) != (int)chunk)
+            fatal("Write failed on DBRC checkpoint file '%s'\n", filename);
+        ptr += chunk;
+        len -= chunk;
+    }
+}
+
+/// Read a buffer from a checkpoint file, fatal if that fails
+static void
+gzReadAll(gzFile file, void *buf, size_t len, const std::string &filename)
+{
+    uint8_t *ptr = static_cast<uint8_t *>(buf);
+    while (len > 0) {
+        unsigned chunk = std::min<size_t>(len, 1 << 30);
+        if (gzread(file, ptr, chunk) != (int)chunk)
+            fatal("Read failed on DBRC checkpoint file '%s'\n", filename);
+        ptr += chunk;
+        len -= chunk;
+    }
+}
+
+/**
+ * Configuration of the core from the parameters of the cache. The
+ * parameters the core relies on are checked first, since the core is
+ * built before the body of the constructor runs.
+ */
+static DbrcCore::Config
+coreConfig(const DbrcCacheParams *params, unsigned max_locked_per_bank)
+{
+    unsigned block_size = params->system->cacheLineSize();
+    unsigned capacity = params->size / block_size;
+    unsigned num_banks = params->num_banks;
+    unsigned num_BTH = params->num_BTH;
+    unsigned target_BTH = params->target_BTH;
+    unsigned tlb_size = params->TLB_size;
+    unsigned tlb_assoc = params->TLB_assoc;
+
+    fatal_if(num_banks == 0 || capacity % num_banks != 0,
+             "The %d DBA entries can not be split evenly across %d banks",
+             capacity, num_banks);
+    fatal_if(num_BTH == 0, "DBRC needs at least one BTH level");
+    fatal_if(DbrcGeometry(block_size, num_BTH).regionShift() >= 64,
+             "%d BTH levels of %d byte blocks cover more than 64 bits",
+             num_BTH, block_size);
+    fatal_if(tlb_assoc == 0 || tlb_size % tlb_assoc != 0 ||
+             !isPowerOf2(tlb_size / tlb_assoc),
+             "A TLB of %d entries can not have %d ways, the number of sets "
+             "must be a power of two", tlb_size, tlb_assoc);
+    fatal_if(params->MNA == 0,
+             "MNA must allow at least one replacement attempt");
+    fatal_if(target_BTH == 0, "target_BTH must be at least 1, the L0T is "
+             "not cached in the TLB");
+    fatal_if(target_BTH < num_BTH && (block_size < 32 || num_BTH >= 32),
+             "Caching tables in the TLB needs blocks of at least 32 bytes "
+             "and less than 32 BTH levels");
+    unsigned entries_per_bank = capacity / num_banks;
+    fatal_if(params->max_locked_fraction < 0 ||
+             entries_per_bank -
+             std::min(max_locked_per_bank, entries_per_bank) < num_BTH,
+             "max_locked_fraction must leave num_BTH (%d) entries of each "
+             "bank replaceable", num_BTH);
+
+    DbrcCore::Config config;
+    config.blockSize = params->system->cacheLineSize();
+    config.capacity = params->size / config.blockSize;
+    config.numBanks = params->num_banks;
+    config.numBTH = params->num_BTH;
+    config.targetBTH = params->target_BTH;
+    config.tlbSize = params->TLB_size;
+    config.tlbAssoc = params->TLB_assoc;
+    config.mna = params->MNA;
+    switch (params->replacement_policy) {
+      case Enums::Clock:
+        config.policy = DbrcCore::Clock;
+        break;
+      case Enums::SRRIP:
+        config.policy = DbrcCore::SRRIP;
+        break;
+      case Enums::BRRIP:
+        config.policy = DbrcCore::BRRIP;
+        break;
+      case Enums::TreePLRU:
+        config.policy = DbrcCore::TreePLRU;
+        break;
+      case Enums::LevelAware:
+        config.policy = DbrcCore::LevelAware;
+        break;
+      default:
+        panic("Unknown DBRC replacement policy");
     }
-    return y;
+    config.maxLockedPerBank = max_locked_per_bank;
+    for (const auto &range : params->locked_ranges)
+        config.lockedRanges.emplace_back(range.start(), range.end());
+    return config;
 }
 
 DbrcCache::DbrcCache(DbrcCacheParams *params) :
     ClockedObject(params),
-    latency(params->latency),
+    tlbLatency(params->tlb_latency),
+    perLevelLatency(params->per_level_latency),
+    dataLatency(params->data_latency),
     blockSize(params->system->cacheLineSize()),
     capacity(params->size / blockSize),
+    numBanks(params->num_banks),
+    entriesPerBank(numBanks ? capacity / numBanks : 0),
+    numMSHRs(params->mshrs),
+    tgtsPerMSHR(params->tgts_per_mshr),
+    numWriteBuffers(params->write_buffers),
     target_BTH(params->target_BTH),
     num_BTH(params->num_BTH),
     TLB_size(params->TLB_size),
-    // TLB_size((0x100000000/blockSize)/(pow(blockSize/2, num_BTH-1))),
+    TLB_assoc(params->TLB_assoc),
     MNA(params->MNA),
-    memPort(params->name + ".mem_side", this),
-    blocked(false), originalPacket(nullptr), waitingPortId(-1), stats(this)
+    replacementPolicy(params->replacement_policy),
+    maxLockedPerBank(entriesPerBank *
+                     std::max(0.0, params->max_locked_fraction)),
+    prefetchDegree(params->prefetch_degree),
+    prefetchPaths(params->prefetch_paths),
+    portQueueSize(params->port_queue_size),
+    arbitration(params->arbitration),
+    requestorWeights(params->requestor_weights),
+    system(params->system),
+    memPort(params->name + ".mem_side", this), arbiterNext(0),
+    arbitrateEvent([this]{ arbitrate(); }, name() + ".arbitrateEvent"),
+    blocked(false), respBlocked(false), pendingResponses(0), splitPort(-1),
+    coreListener(this),
+    core(coreConfig(params, maxLockedPerBank), &coreListener),
+    cache_TLB(core.getTLB()), cache_DBA(core.getDBA()), evictions(nullptr),
+    stats(this)
 {
     // Since the CPU side ports are a vector of ports, create an instance of
     // the CPUSidePort for each connection. This member of params is
@@ -34,31 +155,51 @@ DbrcCache::DbrcCache(DbrcCacheParams *params) :
     for (int i = 0; i < params->port_cpu_side_connection_count; ++i) {
         cpuPorts.emplace_back(name() + csprintf(".cpu_side[%d]", i), i, this);
     }
-
-    VBIR = 0;
-
-    L0T_offset = blockSize;
-    for(size_t i = 1; i < num_BTH; i++)
-        L0T_offset *= (blockSize/2);
-    cache_L0T = (BTH_entry*)calloc((1UL<<32)/(L0T_offset), sizeof(BTH_entry));
-    cache_DBA = (DBA_entry*)calloc(capacity, sizeof(DBA_entry));
-
-    for (size_t i = 0; i < capacity; i++)
-    {
-        cache_DBA[i].BTH = (BTH_entry*)calloc(blockSize/2, sizeof(BTH_entry));
-        cache_DBA[i].data = (uint8_t*)calloc(blockSize, sizeof(uint8_t));
+    inputQueues.resize(cpuPorts.size(), InputQueue{{}, 0});
+
+    fatal_if(portQueueSize == 0, "port_queue_size must be at least 1");
+    fatal_if(std::find(requestorWeights.begin(), requestorWeights.end(), 0) !=
+             requestorWeights.end(), "Requestor weights must be at least 1");
+    stats.portRequests.init(cpuPorts.size());
+    stats.portRefusals.init(cpuPorts.size());
+    stats.portQueueLatency.init(cpuPorts.size());
+    for (unsigned i = 0; i < cpuPorts.size(); i++) {
+        stats.portRequests.subname(i, csprintf("port%d", i));
+        stats.portRefusals.subname(i, csprintf("port%d", i));
+        stats.portQueueLatency.subname(i, csprintf("port%d", i));
     }
-}
 
-DbrcCache::~DbrcCache()
-{
-    for (size_t i = 0; i < capacity; i++)
-    {
-        free(cache_DBA[i].data);
+    // The parameters of the core were checked by coreConfig()
+    bankNextIssue.resize(numBanks, 0);
+    stats.bankAccesses.init(numBanks);
+
+    fatal_if(numWriteBuffers < num_BTH,
+             "An insert replaces up to num_BTH (%d) dirty blocks, tables "
+             "only if their subtree fits in the write buffers left, but "
+             "there are only %d write buffers", num_BTH, numWriteBuffers);
+
+    // The shape of these depends on the tree
+    stats.walkHits.init(num_BTH);
+    stats.walkMisses.init(num_BTH);
+    for (unsigned i = 0; i < num_BTH; i++) {
+        stats.walkHits.subname(i, csprintf("level%d", i + 1));
+        stats.walkMisses.subname(i, csprintf("level%d", i + 1));
+    }
+    stats.insertLevels.init(1, num_BTH, 1);
+    stats.victimScanLength.init(1, MNA, 1);
+
+    const std::string &trace_file = params->trace_file;
+    if (!trace_file.empty()) {
+        bool compress = trace_file.size() > 3 &&
+            trace_file.compare(trace_file.size() - 3, 3, ".gz") == 0;
+        try {
+            recorder.reset(new DbrcTraceRecorder(simout.resolve(trace_file),
+                                                 compress));
+        } catch (const std::runtime_error &e) {
+            fatal("%s: %s\n", name(), e.what());
+        }
+        registerExitCallback([this]() { closeTrace(); });
     }
-    
-    free(cache_L0T);
-    free(cache_DBA);
 }
 
 Port &
@@ -81,15 +222,19 @@ DbrcCache::getPort(const std::string &if_name, PortID idx)
 void
 DbrcCache::CPUSidePort::sendPacket(PacketPtr pkt)
 {
-    // Note: This flow control is very simple since the cache is blocking.
-
-    panic_if(blockedPacket != nullptr, "Should never try to send if blocked!");
+    // Keep responses in order behind any that are already waiting.
+    if (!blockedPackets.empty()) {
+        DPRINTF(DbrcCache, "Queueing %s behind blocked response\n",
+                pkt->print());
+        blockedPackets.push_back(pkt);
+        return;
+    }
 
     // If we can't send the packet across the port, store it for later.
     DPRINTF(DbrcCache, "Sending %s to CPU\n", pkt->print());
     if (!sendTimingResp(pkt)) {
         DPRINTF(DbrcCache, "failed!\n");
-        blockedPacket = pkt;
+        blockedPackets.push_back(pkt);
     }
 }
 
@@ -102,7 +247,7 @@ DbrcCache::CPUSidePort::getAddrRanges() const
 void
 DbrcCache::CPUSidePort::trySendRetry()
 {
-    if (needRetry && blockedPacket == nullptr) {
+    if (needRetry && blockedPackets.empty()) {
         // Only send a retry if the port is now completely free
         needRetry = false;
         DPRINTF(DbrcCache, "Sending retry req.\n");
@@ -110,11 +255,17 @@ DbrcCache::CPUSidePort::trySendRetry()
     }
 }
 
+Tick
+DbrcCache::CPUSidePort::recvAtomic(PacketPtr pkt)
+{
+    return owner->handleAtomic(pkt, id);
+}
+
 void
 DbrcCache::CPUSidePort::recvFunctional(PacketPtr pkt)
 {
     // Just forward to the cache.
-    return owner->handleFunctional(pkt);
+    return owner->handleFunctional(pkt, id);
 }
 
 bool
@@ -122,20 +273,27 @@ DbrcCache::CPUSidePort::recvTimingReq(PacketPtr pkt)
 {
     DPRINTF(DbrcCache, "Got request %s\n", pkt->print());
 
-    if (blockedPacket || needRetry) {
+    if (pkt->cacheResponding()) {
+        // A cache above responds, this is only coherence bookkeeping and
+        // is never blocked
+        owner->handleCacheResponding(pkt, true);
+        return true;
+    }
+
+    if (!blockedPackets.empty() || needRetry) {
         // The cache may not be able to send a reply if this is blocked
         DPRINTF(DbrcCache, "Request blocked\n");
         needRetry = true;
         return false;
     }
-    // Just forward to the cache.
-    if (!owner->handleRequest(pkt, id)) {
-        DPRINTF(DbrcCache, "Request failed\n");
+    // Queue it for the arbiter.
+    if (!owner->queueRequest(pkt, id)) {
+        DPRINTF(DbrcCache, "Input queue full\n");
         // stalling
         needRetry = true;
         return false;
     } else {
-        DPRINTF(DbrcCache, "Request succeeded\n");
+        DPRINTF(DbrcCache, "Request queued\n");
         return true;
     }
 }
@@ -144,25 +302,38 @@ void
 DbrcCache::CPUSidePort::recvRespRetry()
 {
     // We should have a blocked packet if this function is called.
-    assert(blockedPacket != nullptr);
-
-    // Grab the blocked packet.
-    PacketPtr pkt = blockedPacket;
-    blockedPacket = nullptr;
-
-    DPRINTF(DbrcCache, "Retrying response pkt %s\n", pkt->print());
-    // Try to resend it. It's possible that it fails again.
-    sendPacket(pkt);
+    assert(!blockedPackets.empty());
+
+    // Send as many of the queued responses as the peer will take.
+    while (!blockedPackets.empty()) {
+        PacketPtr pkt = blockedPackets.front();
+        DPRINTF(DbrcCache, "Retrying response pkt %s\n", pkt->print());
+        if (!sendTimingResp(pkt)) {
+            // Wait for the next retry
+            return;
+        }
+        blockedPackets.pop_front();
+    }
 
     // We may now be able to accept new packets
     trySendRetry();
+
+    owner->tryDrainDone();
+}
+
+bool
+DbrcCache::CPUSidePort::recvTimingSnoopResp(PacketPtr pkt)
+{
+    // Just forward to the cache.
+    owner->handleSnoopResponse(pkt);
+    return true;
 }
 
 void
 DbrcCache::MemSidePort::sendPacket(PacketPtr pkt)
 {
-    // Note: This flow control is very simple since the cache is blocking.
-
+    // The callers check isBlocked() first, the port holds a single refused
+    // packet until the retry
     panic_if(blockedPacket != nullptr, "Should never try to send if blocked!");
 
     // If we can't send the packet across the port, store it for later.
@@ -190,6 +361,16 @@ DbrcCache::MemSidePort::recvReqRetry()
 
     // Try to resend it. It's possible that it fails again.
     sendPacket(pkt);
+
+    // Writebacks and fills that were held back while we were blocked can
+    // go now
+    owner->sendWritebacks();
+    owner->sendMSHRFills();
+
+    // So can the uncacheable accesses that were refused
+    owner->scheduleArbitration();
+
+    owner->tryDrainDone();
 }
 
 void
@@ -198,30 +379,180 @@ DbrcCache::MemSidePort::recvRangeChange()
     owner->sendRangeChange();
 }
 
+void
+DbrcCache::MemSidePort::sendSnoopResp(PacketPtr pkt)
+{
+    // Keep snoop responses in order behind any that are already waiting.
+    if (!blockedSnoopResps.empty() || !sendTimingSnoopResp(pkt)) {
+        DPRINTF(DbrcCache, "Queueing snoop response %s\n", pkt->print());
+        blockedSnoopResps.push_back(pkt);
+    }
+}
+
+void
+DbrcCache::MemSidePort::recvTimingSnoopReq(PacketPtr pkt)
+{
+    // Just forward to the cache.
+    owner->handleSnoop(pkt, true);
+}
+
+Tick
+DbrcCache::MemSidePort::recvAtomicSnoop(PacketPtr pkt)
+{
+    // Just forward to the cache.
+    return owner->handleSnoop(pkt, false);
+}
+
+void
+DbrcCache::MemSidePort::recvFunctionalSnoop(PacketPtr pkt)
+{
+    // Just forward to the cache.
+    owner->handleFunctionalSnoop(pkt);
+}
+
+void
+DbrcCache::MemSidePort::recvRetrySnoopResp()
+{
+    // Send as many of the queued snoop responses as the peer will take.
+    while (!blockedSnoopResps.empty()) {
+        if (!sendTimingSnoopResp(blockedSnoopResps.front())) {
+            // Wait for the next retry
+            return;
+        }
+        blockedSnoopResps.pop_front();
+    }
+
+    owner->tryDrainDone();
+}
+
+bool
+DbrcCache::queueRequest(PacketPtr pkt, int port_id)
+{
+    InputQueue &queue = inputQueues[port_id];
+    if (queue.requests.size() >= portQueueSize) {
+        stats.portRefusals[port_id]++;
+        return false;
+    }
+    queue.requests.emplace_back(pkt, curTick());
+    scheduleArbitration();
+    return true;
+}
+
+void
+DbrcCache::scheduleArbitration()
+{
+    if (!arbitrateEvent.scheduled())
+        schedule(arbitrateEvent, curTick());
+}
+
+void
+DbrcCache::arbitrate()
+{
+    // The rest of a split access goes first
+    issueSplitParts();
+
+    std::vector<bool> refused(cpuPorts.size(), false);
+    int port_id;
+    while ((port_id = selectPort(refused)) >= 0) {
+        InputQueue &queue = inputQueues[port_id];
+        PacketPtr pkt = queue.requests.front().first;
+        Tick arrival = queue.requests.front().second;
+
+        if (!handleRequest(pkt, port_id)) {
+            // Give the grant back, the port keeps its turn
+            DPRINTF(DbrcCache, "Port %d refused\n", port_id);
+            refused[port_id] = true;
+            queue.credit++;
+            continue;
+        }
+
+        stats.portRequests[port_id]++;
+        stats.portQueueLatency[port_id] += curTick() - arrival;
+        queue.requests.pop_front();
+
+        // There is room in the queue again
+        cpuPorts[port_id].trySendRetry();
+    }
+
+    tryDrainDone();
+}
+
+int
+DbrcCache::selectPort(const std::vector<bool> &refused)
+{
+    for (unsigned i = 0; i < cpuPorts.size(); i++) {
+        unsigned port_id = (arbiterNext + i) % cpuPorts.size();
+        InputQueue &queue = inputQueues[port_id];
+        if (refused[port_id] || queue.requests.empty())
+            continue;
+
+        if (queue.credit == 0) {
+            // A new turn
+            queue.credit = arbitration == Enums::WeightedQoS ?
+                requestorWeight(
+                    queue.requests.front().first->req->requestorId()) : 1;
+        }
+        // The port keeps the turn until it has used all of its grants
+        queue.credit--;
+        arbiterNext = queue.credit > 0 ? port_id :
+                                         (port_id + 1) % cpuPorts.size();
+        return port_id;
+    }
+    return -1;
+}
+
+unsigned
+DbrcCache::requestorWeight(RequestorID requestor) const
+{
+    return requestor < requestorWeights.size() ?
+        requestorWeights[requestor] : 1;
+}
+
 /**
- * @brief Handle requests for a blocking cache. Delay by cache latency.
+ * @brief Handle requests for a non-blocking cache. Accept unless the MSHRs
+ * are exhausted.
  */
 bool
 DbrcCache::handleRequest(PacketPtr pkt, int port_id)
 {
-    if (blocked) {
-        // There is currently an outstanding request so we can't respond. Stall
+    if (blocked || !splitParts.empty()) {
+        // No MSHR is free, so a miss could not be tracked, or the parts
+        // of a split access are waiting for one. Stall
         return false;
     }
 
     DPRINTF(DbrcCache, "Got request for addr %#x\n", pkt->getAddr());
 
-    // This cache is now blocked waiting for the response to this packet.
-    blocked = true;
+    // The packet may be gone once it has been handled
+    Addr block_addr = pkt->getBlockAddr(blockSize);
 
-    // Store the port for when we get the response
-    assert(waitingPortId == -1);
-    waitingPortId = port_id;
+    if (backInvalidations.count(block_addr)) {
+        // The newest data of the block is on its way back from above.
+        // Retry once it is here.
+        DPRINTF(DbrcCache, "Back-invalidation of %#x pending\n", block_addr);
+        return false;
+    }
 
-    // Schedule an event after cache access latency to actually access
-    schedule(new EventFunctionWrapper([this, pkt]{ accessTiming(pkt); },
-                                      name() + ".accessEvent", true),
-             clockEdge(latency));
+    if (pkt->req->isUncacheable()) {
+        // Forward to the memory side as it is
+        if (memPort.isBlocked())
+            return false;
+        stats.uncacheableAccesses++;
+        if (pkt->needsResponse()) {
+            pkt->pushSenderState(new UncacheableAccess(port_id));
+            pendingResponses++;
+        }
+        memPort.sendPacket(pkt);
+        return true;
+    }
+    RequestorID requestor = pkt->req->requestorId();
+    bool demand = pkt->needsResponse();
+
+    recordAccess(pkt, port_id);
+    accessTiming(pkt, port_id);
+
+    if (prefetchDegree > 0 && demand)
+        trainPrefetcher(block_addr, requestor);
 
     return true;
 }
@@ -229,78 +560,1124 @@ DbrcCache::handleRequest(PacketPtr pkt, int port_id)
 bool
 DbrcCache::handleResponse(PacketPtr pkt)
 {
-    assert(blocked);
     DPRINTF(DbrcCache, "Got response for addr %#x\n", pkt->getAddr());
 
+    if (pkt->req->isUncacheable()) {
+        // The response of a forwarded access
+        auto uncacheable =
+            dynamic_cast<UncacheableAccess *>(pkt->popSenderState());
+        assert(uncacheable);
+        int port_id = uncacheable->portId;
+        delete uncacheable;
+        pendingResponses--;
+        sendResponse(pkt, port_id);
+        tryDrainDone();
+        return true;
+    }
+
+    auto mshr = std::find_if(mshrQueue.begin(), mshrQueue.end(),
+        [pkt](const MSHR &m) { return m.blockAddr == pkt->getAddr(); });
+    panic_if(mshr == mshrQueue.end(), "Response without an MSHR");
+    assert(mshr->inService);
+
+    if (!writeBufferHasRoom()) {
+        // The insert could not queue its writebacks. Refuse the response,
+        // sending the writebacks retries it.
+        DPRINTF(DbrcCache, "Write buffer full, refusing response\n");
+        respBlocked = true;
+        return false;
+    }
+
     // For now assume that inserts are off of the critical path and don't count
-    // for any added latency.
-    insert(pkt);
-
-    stats.missLatency.sample(curTick() - missTime);
-
-    // If we had to upgrade the request packet to a full cache line, now we
-    // can use that packet to construct the response.
-    if (originalPacket != nullptr) {
-        DPRINTF(DbrcCache, "Copying data from new packet to old\n");
-        // We had to upgrade a previous packet. We can functionally deal with
-        // the cache access now. It better be a hit.
-        M5_VAR_USED bool hit = accessFunctional(originalPacket);
+    // for any added latency. They do take a slot in the bank pipeline.
+    accessBank(pkt->getAddr(), dataLatency);
+    uint32_t index;
+    if (core.findBlock(mshr->blockAddr, index)) {
+        // The block was only made writable, our copy is up to date
+        assert(mshr->needsWritable);
+        DUT_entry &dut = cache_DBA.dut(index);
+        dut.W = !pkt->hasSharers();
+        // A cache that had the block Modified passed its ownership on
+        dut.D = dut.D || pkt->cacheResponding();
+    } else {
+        PacketList writebacks;
+        insert(pkt->getAddr(), pkt->getConstPtr<uint8_t>(), writebacks,
+               pkt->cacheResponding(), !pkt->hasSharers());
+        doWritebacks(writebacks);
+        M5_VAR_USED bool found = core.findBlock(mshr->blockAddr, index);
+        assert(found);
+    }
+    if (mshr->prefetch)
+        prefetchedBlocks.insert(mshr->blockAddr);
+
+    // Service the targets in the order they were received. Every one of them
+    // hits now that the block has been installed, unless it needs write
+    // permission and the block came back shared.
+    auto target = mshr->targets.begin();
+    for (; target != mshr->targets.end(); ++target) {
+        if (target->pkt->needsWritable() && !cache_DBA.dut(index).W)
+            break;
+
+        stats.missLatency.sample(curTick() - target->recvTime);
+
+        M5_VAR_USED bool hit = accessFunctional(target->pkt);
         panic_if(!hit, "Should always hit after inserting");
-        originalPacket->makeResponse();
-        delete pkt; // We may need to delay this, I'm not sure.
-        pkt = originalPacket;
-        originalPacket = nullptr;
-    } // else, pkt contains the data it needs
 
-    sendResponse(pkt);
+        if (target->pkt->needsResponse()) {
+            target->pkt->makeResponse();
+            sendResponse(target->pkt, target->portId);
+        } else {
+            // Writebacks are sunk here
+            delete target->pkt;
+        }
+    }
+    mshr->targets.erase(mshr->targets.begin(), target);
+
+    // Answer the snoops that were ordered after the fill with the block
+    // as the targets left it
+    bool invalidate = mshr->postInvalidate;
+    for (auto snoop : mshr->deferredSnoops) {
+        invalidate = invalidate || snoop->isInvalidate();
+        supplySnoopResponse(snoop, cache_DBA.data(index), true,
+                            clockEdge(dataLatency));
+        delete snoop;
+    }
+    if (invalidate) {
+        invalidateBlock(index);
+    } else if (!mshr->deferredSnoops.empty() || mshr->postDowngrade) {
+        cache_DBA.dut(index).W = false;
+    }
+    mshr->deferredSnoops.clear();
+    mshr->postInvalidate = mshr->postDowngrade = false;
+    delete pkt;
+
+    if (!mshr->targets.empty()) {
+        // Fetch the block again, with write permission this time
+        DPRINTF(DbrcCache, "Refetching %#x to write it\n", mshr->blockAddr);
+        mshr->needsWritable = true;
+        mshr->inService = false;
+        mshr->readyTime = curTick();
+        sendMSHRFills();
+    } else {
+        mshrQueue.erase(mshr);
+    }
+
+    updateBlocked();
+
+    tryDrainDone();
 
     return true;
 }
 
-void DbrcCache::sendResponse(PacketPtr pkt)
+void DbrcCache::sendResponse(PacketPtr pkt, int port_id)
 {
-    assert(blocked);
+    auto split = dynamic_cast<SplitAccess *>(pkt->senderState);
+    if (split) {
+        // A part of a split access. Its data is already in the original.
+        delete pkt;
+        if (--split->outstanding > 0)
+            return;
+        pkt = split->pkt;
+        delete split;
+        pkt->makeResponse();
+    }
+
     DPRINTF(DbrcCache, "Sending resp for addr %#x\n", pkt->getAddr());
 
-    int port = waitingPortId;
+    // Simply forward to the cpu port
+    cpuPorts[port_id].sendPacket(pkt);
+}
+
+Tick
+DbrcCache::handleCacheResponding(PacketPtr pkt, bool is_timing)
+{
+    DPRINTF(DbrcCache, "Cache above responding to %s\n", pkt->print());
+
+    // Only a responder with the block dirty, but not writable, lets the
+    // request through. The other copies have to be invalidated.
+    assert(pkt->needsWritable() && !pkt->responderHadWritable());
+
+    // Nothing outside holds the block if our copy is writable
+    uint32_t index;
+    bool found = core.findBlock(pkt->getBlockAddr(blockSize), index);
+    bool writable = found && cache_DBA.dut(index).W;
+
+    Tick lat = 0;
+    if (is_timing) {
+        if (!writable) {
+            // Send an express snoop towards memory. The crossbars snoop the
+            // other caches on the way, and the point of coherency sinks it.
+            PacketPtr snoop_pkt = new Packet(pkt, true, false);
+            snoop_pkt->headerDelay = snoop_pkt->payloadDelay = 0;
+            snoop_pkt->setExpressSnoop();
+            snoop_pkt->setCacheResponding();
+            M5_VAR_USED bool success = memPort.sendTimingReq(snoop_pkt);
+            // Express snoops always succeed
+            assert(success);
+        }
+        // The sender still uses the packet
+        pendingDelete.reset(pkt);
+    } else if (!writable) {
+        lat = memPort.sendAtomic(pkt);
+    }
+
+    // The copies outside are gone
+    if (found)
+        cache_DBA.dut(index).W = true;
 
-    // The packet is now done. We're about to put it in the port, no need for
-    // this object to continue to stall.
-    // We need to free the resource before sending the packet in case the CPU
-    // tries to send another request immediately (e.g., in the same callchain).
-    blocked = false;
-    waitingPortId = -1;
+    return lat;
+}
 
-    // Simply forward to the memory port
-    cpuPorts[port].sendPacket(pkt);
+Tick
+DbrcCache::handleSnoop(PacketPtr pkt, bool is_timing)
+{
+    DPRINTF(DbrcCache, "Snooped %s\n", pkt->print());
+    stats.snoops++;
 
-    // For each of the cpu ports, if it needs to send a retry, it should do it
-    // now since this memory object may be unblocked now.
-    for (auto& port : cpuPorts) {
-        port.trySendRetry();
+    // The packet becomes a response if a cache above responds in atomic
+    // mode, so look at it first
+    Addr block_addr = pkt->getBlockAddr(blockSize);
+    bool invalidate = pkt->isInvalidate();
+    bool needs_response = pkt->needsResponse() && !pkt->cacheResponding();
+    bool uncacheable = pkt->req->isUncacheable();
+
+    // Looking the block up walks the tree unless it is in the TLB
+    Cycles lat = tlbLatency;
+    if (!cache_TLB.contains(block_addr / blockSize))
+        lat = lat + Cycles(perLevelLatency * num_BTH);
+
+    auto back_inval = backInvalidations.find(block_addr);
+    if (back_inval != backInvalidations.end()) {
+        // The block was replaced and its newest data is on its way back
+        // from above. Answer once it is here.
+        if (needs_response) {
+            pkt->setCacheResponding();
+            if (!back_inval->second.writable)
+                pkt->setHasSharers();
+            back_inval->second.deferredSnoops.push_back(
+                new Packet(pkt, false, true));
+            stats.snoopsDeferred++;
+        }
+        return cyclesToTicks(lat);
+    }
+
+    MSHR *mshr = findMSHR(block_addr);
+    if (mshr && mshr->inService && !memPort.isBlockedOn(block_addr) &&
+        !uncacheable) {
+        // Our fill was ordered first
+        if (mshr->needsWritable && needs_response && !pkt->isWrite()) {
+            // The block comes back modified, so we are its owner. Answer
+            // once it is here.
+            pkt->setCacheResponding();
+            if (!invalidate)
+                pkt->setHasSharers();
+            mshr->deferredSnoops.push_back(new Packet(pkt, false, true));
+            stats.snoopsDeferred++;
+            return cyclesToTicks(lat);
+        }
+        // The block is not ours to supply, whoever owns it now answers.
+        // The fill must not leave it valid or writable behind the snoop.
+        if (invalidate) {
+            mshr->postInvalidate = true;
+        } else if (pkt->isRead()) {
+            pkt->setHasSharers();
+            mshr->postDowngrade = true;
+        }
     }
+
+    uint32_t index;
+    if (!core.findBlock(block_addr, index))
+        return cyclesToTicks(lat);
+
+    stats.snoopHits++;
+    DUT_entry &dut = cache_DBA.dut(index);
+
+    if (pkt->isEviction()) {
+        // An eviction from another cache only needs to know that the
+        // block is still cached
+        pkt->setBlockCached();
+        return cyclesToTicks(lat);
+    }
+
+    // The caches above may hold a newer copy
+    Tick snoop_lat = 0;
+    if (dut.C) {
+        if (is_timing) {
+            // Snoop with a copy, the flags of the caches above are copied
+            // back
+            Packet snoop_pkt(pkt, true, true);
+            snoop_pkt.setExpressSnoop();
+            snoop_pkt.headerDelay = snoop_pkt.payloadDelay = 0;
+            snoopUp(&snoop_pkt, true);
+            if (snoop_pkt.isBlockCached())
+                pkt->setBlockCached();
+            pkt->copyResponderFlags(&snoop_pkt);
+        } else {
+            snoop_lat = snoopUp(pkt, false);
+        }
+        if (invalidate)
+            dut.C = false;
+    }
+
+    bool respond = dut.D && needs_response && !pkt->cacheResponding();
+
+    if (!uncacheable && pkt->isRead() && !invalidate) {
+        // Someone else reads the block, it is shared from now on. A dirty
+        // block stays dirty, we remain its owner.
+        pkt->setHasSharers();
+        dut.W = false;
+    }
+
+    if (respond) {
+        stats.snoopResponses++;
+        pkt->setCacheResponding();
+        if (dut.W)
+            pkt->setResponderHadWritable();
+        lat = lat + dataLatency;
+        supplySnoopResponse(pkt, cache_DBA.data(index), is_timing,
+                            clockEdge(lat));
+    }
+
+    if (invalidate)
+        invalidateBlock(index);
+
+    return cyclesToTicks(lat) + snoop_lat;
+}
+
+void
+DbrcCache::handleFunctionalSnoop(PacketPtr pkt)
+{
+    uint32_t index;
+    if (!core.findBlock(pkt->getBlockAddr(blockSize), index))
+        return;
+
+    // The caches above may hold a newer copy
+    if (cache_DBA.dut(index).C) {
+        for (auto &port : cpuPorts) {
+            if (port.isSnooping())
+                port.sendFunctionalSnoop(pkt);
+            if (pkt->isResponse())
+                return;
+        }
+    }
+
+    // Reads are answered here, writes go on to memory as well
+    bool is_read = pkt->isRead();
+    accessBlock(pkt, index);
+    if (is_read)
+        pkt->makeResponse();
+}
+
+void
+DbrcCache::handleSnoopResponse(PacketPtr pkt)
+{
+    Addr block_addr = pkt->getBlockAddr(blockSize);
+    auto back_inval = backInvalidations.find(block_addr);
+    if (back_inval == backInvalidations.end() ||
+        back_inval->second.req != pkt->req) {
+        // A cache above answers a snoop forwarded from the memory side
+        DPRINTF(DbrcCache, "Forwarding snoop response %s\n", pkt->print());
+        pkt->headerDelay = pkt->payloadDelay = 0;
+        memPort.sendSnoopResp(pkt);
+        return;
+    }
+
+    DPRINTF(DbrcCache, "Back-invalidation of %#x got %s\n", block_addr,
+            pkt->print());
+    BackInvalidation &inval = back_inval->second;
+    stats.backInvalidationsDirty++;
+
+    // The snoops that came meanwhile get the data. One that caches the
+    // block without leaving it shared takes its ownership over.
+    bool owned = false;
+    for (auto snoop : inval.deferredSnoops) {
+        owned = owned || (!snoop->req->isUncacheable() &&
+                          (snoop->isInvalidate() || inval.writable));
+        supplySnoopResponse(snoop, pkt->getConstPtr<uint8_t>(), true,
+                            clockEdge(dataLatency));
+        delete snoop;
+    }
+
+    if (!owned) {
+        // Write the newest data back, in place of the stale copy if that
+        // one was not sent yet
+        auto wb = std::find_if(writeBuffer.begin(), writeBuffer.end(),
+            [block_addr](PacketPtr p) { return p->getAddr() == block_addr; });
+        if (wb != writeBuffer.end()) {
+            (*wb)->setData(pkt->getConstPtr<uint8_t>());
+        } else {
+            RequestPtr req = std::make_shared<Request>(
+                block_addr, blockSize, 0, 0);
+            PacketPtr wb_pkt = new Packet(req, MemCmd::WritebackDirty,
+                                          blockSize);
+            wb_pkt->allocate();
+            wb_pkt->setData(pkt->getConstPtr<uint8_t>());
+            if (!inval.writable)
+                wb_pkt->setHasSharers();
+
+            stats.writebacks++;
+            stats.writebackBytes += blockSize;
+            // A snoop response can not be refused, so this may fill the
+            // write buffer past its size for a while
+            writeBuffer.push_back(wb_pkt);
+        }
+        sendWritebacks();
+    }
+
+    backInvalidations.erase(back_inval);
+    delete pkt;
+
+    // Accesses to the block that were refused can come now
+    scheduleArbitration();
+    updateBlocked();
+
+    tryDrainDone();
+}
+
+Tick
+DbrcCache::snoopUp(PacketPtr pkt, bool is_timing)
+{
+    // Every port sees the snoop, so that all copies are invalidated, but
+    // only the first cache with the block dirty responds
+    MemCmd orig_cmd = pkt->cmd;
+    MemCmd resp_cmd = orig_cmd;
+    Tick lat = 0;
+    for (auto &port : cpuPorts) {
+        if (!port.isSnooping())
+            continue;
+        if (is_timing) {
+            port.sendTimingSnoopReq(pkt);
+        } else {
+            lat = std::max(lat, port.sendAtomicSnoop(pkt));
+            if (pkt->isResponse()) {
+                resp_cmd = pkt->cmd;
+                pkt->cmd = orig_cmd;
+            }
+        }
+    }
+    pkt->cmd = resp_cmd;
+    return lat;
+}
+
+void
+DbrcCache::supplySnoopResponse(PacketPtr pkt, const uint8_t *data,
+                               bool is_timing, Tick when)
+{
+    DPRINTF(DbrcCache, "Responding to snoop %s\n", pkt->print());
+
+    if (!is_timing) {
+        pkt->makeAtomicResponse();
+        // Upgrades carry no data
+        if (pkt->hasData())
+            pkt->setDataFromBlock(data, blockSize);
+        return;
+    }
+
+    // The snoop still belongs to the requestor, respond with a copy
+    PacketPtr resp = new Packet(pkt, false, true);
+    resp->makeTimingResponse();
+    if (resp->hasData())
+        resp->setDataFromBlock(data, blockSize);
+    resp->headerDelay = resp->payloadDelay = 0;
+
+    pendingResponses++;
+    schedule(new EventFunctionWrapper([this, resp]
+                                      {
+                                          pendingResponses--;
+                                          memPort.sendSnoopResp(resp);
+                                          tryDrainDone();
+                                      },
+                                      name() + ".snoopRespEvent", true),
+             when);
+}
+
+DbrcCache::MSHR *
+DbrcCache::findMSHR(Addr block_addr)
+{
+    for (auto &mshr : mshrQueue) {
+        if (mshr.blockAddr == block_addr)
+            return &mshr;
+    }
+    return nullptr;
+}
+
+DbrcCache::MSHR &
+DbrcCache::allocateMSHR(Addr block_addr, const RequestPtr &req, Tick ready)
+{
+    assert(mshrQueue.size() < numMSHRs);
+
+    mshrQueue.emplace_back();
+    MSHR &mshr = mshrQueue.back();
+    mshr.blockAddr = block_addr;
+    mshr.req = req;
+    mshr.prefetch = false;
+    mshr.needsWritable = false;
+    mshr.postInvalidate = false;
+    mshr.postDowngrade = false;
+    mshr.readyTime = ready;
+    mshr.inService = false;
+
+    DPRINTF(DbrcCache, "Allocated MSHR for %#x\n", mshr.blockAddr);
+
+    // Resolving the miss takes the lookup before the fill goes out
+    schedule(new EventFunctionWrapper([this]{ sendMSHRFills(); },
+                                      name() + ".fillEvent", true),
+             mshr.readyTime);
+
+    return mshr;
+}
+
+Tick
+DbrcCache::accessBank(Addr block_addr, Cycles lat)
+{
+    unsigned bank_id = core.bankOf(block_addr);
+    Tick &next_issue = bankNextIssue[bank_id];
+
+    Tick start = clockEdge();
+    if (next_issue > start) {
+        DPRINTF(DbrcCache, "Bank %d conflict for %#x\n", bank_id, block_addr);
+        stats.bankConflicts++;
+        start = next_issue;
+    }
+    // The lookup is pipelined, the next access can start a cycle later
+    next_issue = start + clockPeriod();
+    stats.bankAccesses[bank_id]++;
+
+    return start + cyclesToTicks(lat);
+}
+
+void
+DbrcCache::sendMSHRFills()
+{
+    for (auto &mshr : mshrQueue) {
+        if (memPort.isBlocked()) {
+            // The retry will call us again
+            return;
+        }
+        if (mshr.inService || mshr.readyTime > curTick())
+            continue;
+
+        // Always fetch the whole, aligned block. The original accesses are
+        // answered from the cache once it is installed.
+        MemCmd cmd = mshr.needsWritable ? MemCmd::ReadExReq :
+                                          MemCmd::ReadSharedReq;
+        PacketPtr fill = new Packet(mshr.req, cmd, blockSize);
+        fill->allocate();
+        assert(fill->getAddr() == mshr.blockAddr);
+
+        mshr.inService = true;
+
+        DPRINTF(DbrcCache, "Sending fill for %#x\n", mshr.blockAddr);
+        memPort.sendPacket(fill);
+    }
+}
+
+void
+DbrcCache::sendWritebacks()
+{
+    bool sent = false;
+    while (!writeBuffer.empty() && !memPort.isBlocked()) {
+        PacketPtr wb_pkt = writeBuffer.front();
+        writeBuffer.pop_front();
+
+        DPRINTF(DbrcCache, "Writing packet back %s\n", wb_pkt->print());
+        // Send the write to memory. If it is refused the port holds it until
+        // the retry.
+        memPort.sendPacket(wb_pkt);
+        sent = true;
+    }
+    stats.writeBufferOccupancy = writeBuffer.size();
+
+    if (sent) {
+        // Fills may have been held back by writebacks on the port
+        sendMSHRFills();
+    }
+
+    if (respBlocked && writeBufferHasRoom()) {
+        // The refused fill response can be installed now
+        respBlocked = false;
+        memPort.sendRetryResp();
+    }
+
+    updateBlocked();
+}
+
+bool
+DbrcCache::writeBufferHasRoom() const
+{
+    return writeBufferRoom() >= num_BTH;
+}
+
+unsigned
+DbrcCache::writeBufferRoom() const
+{
+    return writeBuffer.size() < numWriteBuffers ?
+        numWriteBuffers - writeBuffer.size() : 0;
+}
+
+bool
+DbrcCache::reclaimWriteback(Addr block_addr)
+{
+    auto wb = std::find_if(writeBuffer.begin(), writeBuffer.end(),
+        [block_addr](PacketPtr p) { return p->getAddr() == block_addr; });
+    if (wb == writeBuffer.end())
+        return false;
+
+    DPRINTF(DbrcCache, "Reclaiming %#x from the write buffer\n", block_addr);
+    PacketPtr wb_pkt = *wb;
+    writeBuffer.erase(wb);
+    stats.writeBufferHits++;
+
+    // The copy in memory is stale, so the block is still dirty
+    PacketList writebacks;
+    insert(block_addr, wb_pkt->getConstPtr<uint8_t>(), writebacks, true,
+           !wb_pkt->hasSharers());
+    delete wb_pkt;
+    doWritebacks(writebacks);
+
+    return true;
+}
+
+void
+DbrcCache::updateBlocked()
+{
+    bool no_targets = false;
+    for (const auto &mshr : mshrQueue)
+        no_targets |= mshr.targets.size() >= tgtsPerMSHR;
+    bool no_wbuffers = !writeBufferHasRoom();
+    bool now_blocked = mshrQueue.size() >= numMSHRs || no_targets ||
+                       no_wbuffers;
+
+    if (now_blocked && !blocked) {
+        if (no_wbuffers) {
+            DPRINTF(DbrcCache, "Blocking, write buffer full\n");
+            stats.blockedNoWBuffers++;
+        } else {
+            DPRINTF(DbrcCache, "Blocking, MSHRs exhausted\n");
+            stats.blockedNoMSHRs++;
+        }
+    }
+
+    bool unblocked = blocked && !now_blocked;
+    blocked = now_blocked;
+
+    if (unblocked) {
+        // The queued requests are granted in arbitration order, so that no
+        // port always gets the room first.
+        scheduleArbitration();
+    }
+}
+
+bool
+DbrcCache::isDrained() const
+{
+    if (!mshrQueue.empty() || !writeBuffer.empty() || pendingResponses > 0 ||
+        !backInvalidations.empty() || !splitParts.empty() ||
+        memPort.isBlocked() || memPort.hasBlockedSnoopResps())
+        return false;
+    for (const auto &port : cpuPorts) {
+        if (port.isBlocked())
+            return false;
+    }
+    for (const auto &queue : inputQueues) {
+        if (!queue.requests.empty())
+            return false;
+    }
+    return true;
+}
+
+void
+DbrcCache::tryDrainDone()
+{
+    if (drainState() == DrainState::Draining && isDrained()) {
+        DPRINTF(DbrcCache, "Drained\n");
+        signalDrainDone();
+    }
+}
+
+DrainState
+DbrcCache::drain()
+{
+    if (isDrained())
+        return DrainState::Drained;
+
+    DPRINTF(DbrcCache, "Draining, %d MSHRs outstanding\n", mshrQueue.size());
+    return DrainState::Draining;
+}
+
+void
+DbrcCache::serialize(CheckpointOut &cp) const
+{
+    panic_if(!isDrained(), "Checkpointing a DBRC that is not drained");
+
+    // Geometry, checked on restore
+    SERIALIZE_SCALAR(blockSize);
+    SERIALIZE_SCALAR(capacity);
+    SERIALIZE_SCALAR(num_BTH);
+    SERIALIZE_SCALAR(numBanks);
+
+    std::string replacement_policy =
+        Enums::DbrcReplacementPolicyStrings[replacementPolicy];
+    SERIALIZE_SCALAR(replacement_policy);
+
+    std::vector<uint32_t> VBIR;
+    for (unsigned i = 0; i < numBanks; i++)
+        VBIR.push_back(core.getBank(i).VBIR);
+    SERIALIZE_CONTAINER(VBIR);
+
+    // Ranges locked at run time are not in the parameters
+    std::vector<Addr> lockedStarts, lockedEnds;
+    for (const auto &range : core.getLockedRanges()) {
+        lockedStarts.push_back(range.first);
+        lockedEnds.push_back(range.second);
+    }
+    SERIALIZE_CONTAINER(lockedStarts);
+    SERIALIZE_CONTAINER(lockedEnds);
+
+    // The structures go to a separate compressed file, like the contents
+    // of the physical memory
+    std::string filename = name() + ".dbrc.gz";
+    SERIALIZE_SCALAR(filename);
+
+    std::string filepath = CheckpointIn::dir() + "/" + filename;
+    gzFile file = gzopen(filepath.c_str(), "wb");
+    if (file == NULL)
+        fatal("Can't open DBRC checkpoint file '%s'\n", filepath);
+
+    // DBA payloads, BTH tables, DUT and TT, all in one arena
+    gzWriteAll(file, cache_DBA.raw(), cache_DBA.rawBytes(), filename);
+
+    // Allocated pages of the L0T of each bank
+    for (unsigned i = 0; i < numBanks; i++) {
+        const DbrcCore::Bank &bank = core.getBank(i);
+        uint64_t num_pages = bank.L0T.pages();
+        gzWriteAll(file, &num_pages, sizeof(num_pages), filename);
+        bank.L0T.forEachPage([&](uint64_t page_num,
+                                 const BTH_entry *entries) {
+            gzWriteAll(file, &page_num, sizeof(page_num), filename);
+            gzWriteAll(file, entries,
+                       DbrcL0T::PageEntries * sizeof(BTH_entry), filename);
+        });
+    }
+
+    // TLB entries from the least to the most recently used
+    uint64_t num_tlb = cache_TLB.size();
+    gzWriteAll(file, &num_tlb, sizeof(num_tlb), filename);
+    cache_TLB.forEachLRU([&](DbrcTLB::Key key, DbrcTLB::Value value) {
+        gzWriteAll(file, &key, sizeof(key), filename);
+        gzWriteAll(file, &value, sizeof(value), filename);
+    });
+
+    // State of the replacement policy beyond the DUT
+    const std::vector<uint8_t> &repl_state =
+        core.getReplacement().rawState();
+    uint64_t repl_bytes = repl_state.size();
+    gzWriteAll(file, &repl_bytes, sizeof(repl_bytes), filename);
+    gzWriteAll(file, repl_state.data(), repl_bytes, filename);
+
+    if (gzclose(file))
+        fatal("Close failed on DBRC checkpoint file '%s'\n", filename);
+}
+
+void
+DbrcCache::unserialize(CheckpointIn &cp)
+{
+    unsigned cpt_block_size, cpt_capacity, cpt_num_BTH, cpt_num_banks;
+    paramIn(cp, "blockSize", cpt_block_size);
+    paramIn(cp, "capacity", cpt_capacity);
+    paramIn(cp, "num_BTH", cpt_num_BTH);
+    paramIn(cp, "numBanks", cpt_num_banks);
+    fatal_if(cpt_block_size != blockSize || cpt_capacity != capacity ||
+             cpt_num_BTH != num_BTH || cpt_num_banks != numBanks,
+             "%s: checkpoint of a DBRC with %d entries of %d bytes, %d BTH "
+             "levels and %d banks, this one has %d entries of %d bytes, %d "
+             "and %d\n", name(), cpt_capacity, cpt_block_size, cpt_num_BTH,
+             cpt_num_banks, capacity, blockSize, num_BTH, numBanks);
+
+    std::vector<uint32_t> VBIR;
+    UNSERIALIZE_CONTAINER(VBIR);
+    fatal_if(VBIR.size() != numBanks, "%s: expected %d VBIRs, got %d\n",
+             name(), numBanks, VBIR.size());
+    for (unsigned i = 0; i < numBanks; i++) {
+        core.getBank(i).VBIR = VBIR[i];
+        bankNextIssue[i] = 0;
+    }
+
+    std::vector<Addr> lockedStarts, lockedEnds;
+    UNSERIALIZE_CONTAINER(lockedStarts);
+    UNSERIALIZE_CONTAINER(lockedEnds);
+    fatal_if(lockedStarts.size() != lockedEnds.size(),
+             "%s: malformed locked ranges\n", name());
+    std::vector<DbrcCore::Range> locked_ranges;
+    for (size_t i = 0; i < lockedStarts.size(); i++)
+        locked_ranges.emplace_back(lockedStarts[i], lockedEnds[i]);
+    core.setLockedRanges(locked_ranges);
+
+    std::string filename;
+    UNSERIALIZE_SCALAR(filename);
+
+    std::string filepath = cp.getCptDir() + "/" + filename;
+    gzFile file = gzopen(filepath.c_str(), "rb");
+    if (file == NULL)
+        fatal("Can't open DBRC checkpoint file '%s'\n", filepath);
+
+    gzReadAll(file, cache_DBA.raw(), cache_DBA.rawBytes(), filename);
+
+    // The lock bits are in the DUT
+    core.recountLocked();
+    stats.lockedEntries = core.lockedEntries();
+
+    uint64_t num_pages = 0;
+    for (unsigned b = 0; b < numBanks; b++) {
+        DbrcCore::Bank &bank = core.getBank(b);
+        bank.L0T.clear();
+        uint64_t bank_pages;
+        gzReadAll(file, &bank_pages, sizeof(bank_pages), filename);
+        for (uint64_t i = 0; i < bank_pages; i++) {
+            uint64_t page_num;
+            gzReadAll(file, &page_num, sizeof(page_num), filename);
+            gzReadAll(file, bank.L0T.page(page_num),
+                      DbrcL0T::PageEntries * sizeof(BTH_entry), filename);
+        }
+        num_pages += bank_pages;
+    }
+
+    // A smaller TLB simply keeps the most recently used entries
+    cache_TLB.clear();
+    uint64_t num_tlb;
+    gzReadAll(file, &num_tlb, sizeof(num_tlb), filename);
+    for (uint64_t i = 0; i < num_tlb; i++) {
+        DbrcTLB::Key key;
+        DbrcTLB::Value value;
+        gzReadAll(file, &key, sizeof(key), filename);
+        gzReadAll(file, &value, sizeof(value), filename);
+        cache_TLB.insert(key, value);
+    }
+
+    // The state of another policy is of no use, start from scratch
+    std::string replacement_policy;
+    UNSERIALIZE_SCALAR(replacement_policy);
+    uint64_t repl_bytes;
+    gzReadAll(file, &repl_bytes, sizeof(repl_bytes), filename);
+    std::vector<uint8_t> repl_state(repl_bytes);
+    gzReadAll(file, repl_state.data(), repl_bytes, filename);
+    if (replacement_policy ==
+            Enums::DbrcReplacementPolicyStrings[replacementPolicy] &&
+        repl_bytes == core.getReplacement().rawState().size()) {
+        core.getReplacement().rawState() = repl_state;
+    } else {
+        warn("%s: not restoring the state of the %s replacement policy\n",
+             name(), replacement_policy);
+    }
+
+    if (gzclose(file))
+        fatal("Close failed on DBRC checkpoint file '%s'\n", filename);
+
+    DPRINTF(DbrcCache, "Restored %d L0T pages and %d TLB entries\n",
+            num_pages, num_tlb);
+}
+
+unsigned
+DbrcCache::blocksSpanned(PacketPtr pkt) const
+{
+    if (pkt->getSize() == 0)
+        return 1;
+    Addr first = pkt->getBlockAddr(blockSize);
+    Addr last = (pkt->getAddr() + pkt->getSize() - 1) & ~Addr(blockSize - 1);
+    return (last - first) / blockSize + 1;
+}
+
+void
+DbrcCache::recordAccess(PacketPtr pkt, int port_id)
+{
+    if (!recorder)
+        return;
+
+    DbrcTraceRecord record;
+    record.requestor = port_id;
+    record.write = pkt->isWrite();
+    record.tick = curTick();
+    record.cmd = pkt->cmd.toInt();
+
+    Addr addr = pkt->getAddr();
+    Addr end = addr + pkt->getSize();
+    do {
+        record.addr = addr & ~Addr(blockSize - 1);
+        Addr next = record.addr + blockSize;
+        record.size = std::min(end, next) - addr;
+        stats.tracedAccesses++;
+        if (recorder->record(record))
+            stats.traceStalls++;
+        addr = next;
+    } while (addr < end);
+}
+
+void
+DbrcCache::closeTrace()
+{
+    if (!recorder)
+        return;
+    try {
+        recorder->close();
+    } catch (const std::runtime_error &e) {
+        warn("%s: %s\n", name(), e.what());
+    }
+    DPRINTF(DbrcCache, "Recorded %d accesses\n", recorder->records());
+}
+
+std::vector<PacketPtr>
+DbrcCache::splitPacket(PacketPtr pkt) const
+{
+    std::vector<PacketPtr> parts;
+    uint8_t *data = pkt->getPtr<uint8_t>();
+    Addr addr = pkt->getAddr();
+    Addr end = addr + pkt->getSize();
+    while (addr < end) {
+        Addr next = std::min(end, (addr & ~Addr(blockSize - 1)) + blockSize);
+        RequestPtr req = std::make_shared<Request>(
+            addr, next - addr, pkt->req->getFlags(), pkt->req->requestorId());
+        PacketPtr part = new Packet(req, pkt->cmd);
+        part->dataStatic(data + (addr - pkt->getAddr()));
+        parts.push_back(part);
+        addr = next;
+    }
+    return parts;
+}
+
+void
+DbrcCache::splitTiming(PacketPtr pkt, int port_id)
+{
+    panic_if(!pkt->needsResponse(), "Can not split %s", pkt->print());
+
+    std::vector<PacketPtr> parts = splitPacket(pkt);
+    DPRINTF(DbrcCache, "Splitting %s in %d parts\n", pkt->print(),
+            parts.size());
+    stats.splitAccesses++;
+
+    SplitAccess *split = new SplitAccess(pkt, parts.size());
+    for (auto part : parts) {
+        part->senderState = split;
+        splitParts.push_back(part);
+    }
+    splitPort = port_id;
+    issueSplitParts();
+}
+
+void
+DbrcCache::issueSplitParts()
+{
+    // Every part may miss and needs an MSHR and room for the writebacks
+    // of its walk, which is what blocks the cache. Freeing them schedules
+    // an arbitration, which issues the next parts.
+    while (!splitParts.empty() && !blocked) {
+        PacketPtr part = splitParts.front();
+        splitParts.pop_front();
+        accessTiming(part, splitPort);
+    }
+    if (!splitParts.empty()) {
+        DPRINTF(DbrcCache, "%d parts waiting for room\n",
+                splitParts.size());
+    }
+}
+
+/**
+ * @brief Atomic implementation of cache. Fill from memory if miss, then
+ * access the block. Writebacks are sent atomically as well.
+ */
+Tick
+DbrcCache::handleAtomic(PacketPtr pkt, int port_id)
+{
+    Addr block_addr = pkt->getBlockAddr(blockSize);
+
+    if (pkt->cacheResponding())
+        return handleCacheResponding(pkt, false);
+
+    if (pkt->req->isUncacheable()) {
+        // Forward to the memory side as it is
+        stats.uncacheableAccesses++;
+        return memPort.sendAtomic(pkt);
+    }
+
+    if (blocksSpanned(pkt) > 1) {
+        // The parts are looked up in parallel
+        stats.splitAccesses++;
+        Tick lat = 0;
+        for (auto part : splitPacket(pkt)) {
+            lat = std::max(lat, handleAtomic(part, port_id));
+            delete part;
+        }
+        if (pkt->needsResponse())
+            pkt->makeResponse();
+        return lat;
+    }
+
+    recordAccess(pkt, port_id);
+
+    if (pkt->isEviction() && !pkt->isWrite()) {
+        // Clean evictions carry no data and need no response
+        return 0;
+    }
+
+    DPRINTF(DbrcCache, "Got atomic request for addr %#x\n", pkt->getAddr());
+
+    // A block that is only shared has to be made writable first
+    uint32_t index;
+    bool upgrade = pkt->needsWritable() &&
+                   core.findBlock(block_addr, index) &&
+                   !cache_DBA.dut(index).W;
+
+    Cycles lat = tlbLatency;
+    if (!upgrade && accessFunctional(pkt, &lat)) {
+        stats.hits++;
+        DDUMP(DbrcCache, pkt->getConstPtr<uint8_t>(), pkt->getSize());
+        if (pkt->needsResponse())
+            pkt->makeResponse();
+        return cyclesToTicks(lat);
+    }
+
+    stats.misses++;
+    Tick mem_lat = 0;
+    PacketList writebacks;
+    if (upgrade) {
+        // Get write permission, our copy is up to date
+        stats.upgradeMisses++;
+        Packet fill(pkt->req, MemCmd::ReadExReq, blockSize);
+        fill.allocate();
+
+        DPRINTF(DbrcCache, "Sending atomic upgrade for %#x\n", block_addr);
+        mem_lat = memPort.sendAtomic(&fill);
+        DUT_entry &dut = cache_DBA.dut(index);
+        dut.W = true;
+        dut.D = dut.D || fill.cacheResponding();
+    } else if (pkt->isWrite() && pkt->getSize() == blockSize &&
+               !pkt->needsResponse()) {
+        // A writeback of a whole block. Install it without fetching.
+        insert(block_addr, pkt->getConstPtr<uint8_t>(), writebacks, false,
+               !pkt->hasSharers());
+    } else {
+        assert(pkt->isWrite() || pkt->isRead() || pkt->needsWritable());
+        // Fetch the whole, aligned block and install it
+        Packet fill(pkt->req, pkt->needsWritable() ? MemCmd::ReadExReq :
+                                                     MemCmd::ReadSharedReq,
+                    blockSize);
+        fill.allocate();
+        assert(fill.getAddr() == block_addr);
+
+        DPRINTF(DbrcCache, "Sending atomic fill for %#x\n", block_addr);
+        mem_lat = memPort.sendAtomic(&fill);
+        insert(block_addr, fill.getConstPtr<uint8_t>(), writebacks,
+               fill.cacheResponding(), !fill.hasSharers());
+    }
+
+    M5_VAR_USED bool hit = accessFunctional(pkt);
+    panic_if(!hit, "Should always hit after inserting");
+    if (pkt->needsResponse())
+        pkt->makeResponse();
+
+    doWritebacksAtomic(writebacks);
+
+    Tick total = cyclesToTicks(lat) + mem_lat;
+    stats.missLatency.sample(total);
+    return total;
 }
 
 /**
  * @brief Functional implentation of cache. Respond if hit, forward if miss.
  */
 void
-DbrcCache::handleFunctional(PacketPtr pkt)
+DbrcCache::handleFunctional(PacketPtr pkt, int port_id)
 {
-    if (accessFunctional(pkt)) {
+    if (blocksSpanned(pkt) > 1) {
+        for (auto part : splitPacket(pkt)) {
+            handleFunctional(part, port_id);
+            delete part;
+        }
         pkt->makeResponse();
-    } else {
-        memPort.sendFunctional(pkt);
+        return;
+    }
+
+    recordAccess(pkt, port_id);
+
+    // Queued writes are newer than the cache, the newest first
+    for (auto it = splitParts.rbegin(); it != splitParts.rend(); ++it) {
+        if ((*it)->isWrite() && pkt->trySatisfyFunctional(*it)) {
+            pkt->makeResponse();
+            return;
+        }
     }
+    for (auto &queue : inputQueues) {
+        for (auto it = queue.requests.rbegin(); it != queue.requests.rend();
+             ++it) {
+            if (it->first->isWrite() &&
+                pkt->trySatisfyFunctional(it->first)) {
+                pkt->makeResponse();
+                return;
+            }
+        }
+    }
+
+    // Not a lookup, which would change the TLB and the replacement state
+    uint32_t index;
+    if (core.findBlock(pkt->getBlockAddr(blockSize), index)) {
+        accessBlock(pkt, index);
+        pkt->makeResponse();
+        return;
+    }
+
+    // Evicted blocks are newer in the write buffer than in memory
+    for (auto wb_pkt : writeBuffer) {
+        if (pkt->trySatisfyFunctional(wb_pkt)) {
+            pkt->makeResponse();
+            return;
+        }
+    }
+
+    memPort.sendFunctional(pkt);
 }
 
 /**
- * @brief Craete response packet if hit. Format cache line request and forward if miss.
+ * @brief Respond after the cache latency if hit. Coalesce into an existing
+ * MSHR or allocate a new one if miss.
  */
 void
-DbrcCache::accessTiming(PacketPtr pkt)
+DbrcCache::accessTiming(PacketPtr pkt, int port_id)
 {
-    bool hit = accessFunctional(pkt);
+    if (blocksSpanned(pkt) > 1) {
+        splitTiming(pkt, port_id);
+        return;
+    }
+
+    Addr block_addr = pkt->getBlockAddr(blockSize);
+
+    if (pkt->isEviction() && !pkt->isWrite()) {
+        // Clean evictions carry no data and need no response
+        DPRINTF(DbrcCache, "Dropping %s\n", pkt->print());
+        delete pkt;
+        return;
+    }
+
+    // A block that is still being fetched is not in the cache yet, so this
+    // has to wait for the fill even if it would otherwise hit.
+    MSHR *mshr = findMSHR(block_addr);
+    // A block that is only shared has to be made writable first
+    uint32_t index;
+    bool upgrade = !mshr && pkt->needsWritable() &&
+                   core.findBlock(block_addr, index) &&
+                   !cache_DBA.dut(index).W;
+    Cycles lat = tlbLatency;
+    bool hit = !mshr && !upgrade && accessFunctional(pkt, &lat);
+    if (!hit && !mshr && !upgrade && reclaimWriteback(block_addr)) {
+        // Fetching would return stale data, and there is nothing to fetch
+        M5_VAR_USED bool found = core.findBlock(block_addr, index);
+        assert(found);
+        upgrade = pkt->needsWritable() && !cache_DBA.dut(index).W;
+        hit = !upgrade && accessFunctional(pkt);
+        assert(hit || upgrade);
+        lat = lat + dataLatency;
+    }
+
+    // Every access, hit or miss, goes through the pipeline of its bank
+    Tick lookup_done = accessBank(block_addr, lat);
 
     DPRINTF(DbrcCache, "%s for packet: %s\n", hit ? "Hit" : "Miss",
             pkt->print());
@@ -308,353 +1685,432 @@ DbrcCache::accessTiming(PacketPtr pkt)
     if (hit) {
         // Respond to the CPU side
         stats.hits++; // update stats
+        if (prefetchedBlocks.erase(block_addr))
+            stats.prefetchesUseful++;
+        stats.hitLatency.sample(lookup_done - curTick());
         DDUMP(DbrcCache, pkt->getConstPtr<uint8_t>(), pkt->getSize());
-        pkt->makeResponse();
-        sendResponse(pkt);
+        if (pkt->needsResponse()) {
+            pkt->makeResponse();
+            pendingResponses++;
+            schedule(new EventFunctionWrapper([this, pkt, port_id]
+                                              {
+                                                  pendingResponses--;
+                                                  sendResponse(pkt, port_id);
+                                                  tryDrainDone();
+                                              },
+                                              name() + ".responseEvent", true),
+                     lookup_done);
+        } else {
+            delete pkt;
+        }
+    } else if (mshr) {
+        // Miss under miss to the same block. Wait for the same fill.
+        stats.misses++; // update stats
+        stats.mshrHits++;
+        if (mshr->prefetch) {
+            // The prefetch was issued, but too late to hide the miss
+            stats.prefetchesLate++;
+            mshr->prefetch = false;
+        }
+        DPRINTF(DbrcCache, "Coalescing into MSHR for %#x\n", block_addr);
+        // A fill already sent without write permission is sent again
+        // once it is back
+        if (!mshr->inService)
+            mshr->needsWritable = mshr->needsWritable || pkt->needsWritable();
+        mshr->targets.push_back({pkt, port_id, curTick()});
+        updateBlocked();
     } else {
         stats.misses++; // update stats
-        missTime = curTick();
-        // Forward to the memory side.
-        // We can't directly forward the packet unless it is exactly the size
-        // of the cache line, and aligned. Check for that here.
-        Addr addr = pkt->getAddr();
-        Addr block_addr = pkt->getBlockAddr(blockSize);
-        unsigned size = pkt->getSize();
-        if (addr == block_addr && size == blockSize) {
-            // Aligned and block size. We can just forward.
-            DPRINTF(DbrcCache, "forwarding packet\n");
-            memPort.sendPacket(pkt);
-        } else {
-            DPRINTF(DbrcCache, "Upgrading packet to block size\n");
-            panic_if(addr - block_addr + size > blockSize,
-                     "Cannot handle accesses that span multiple cache lines");
-            // Unaligned access to one cache block
-            assert(pkt->needsResponse());
-            MemCmd cmd;
-            if (pkt->isWrite() || pkt->isRead()) {
-                // Read the data from memory to write into the block.
-                // We'll write the data in the cache (i.e., a writeback cache)
-                cmd = MemCmd::ReadReq;
-            } else {
-                panic("Unknown packet type in upgrade size");
-            }
-
-            // Create a new packet that is blockSize
-            PacketPtr new_pkt = new Packet(pkt->req, cmd, blockSize);
-            new_pkt->allocate();
-
-            // Should now be block aligned
-            assert(new_pkt->getAddr() == new_pkt->getBlockAddr(blockSize));
-
-            // Save the old packet
-            originalPacket = pkt;
-
-            DPRINTF(DbrcCache, "forwarding packet\n");
-            memPort.sendPacket(new_pkt);
+        if (pkt->isWrite() && pkt->getSize() == blockSize &&
+            !pkt->needsResponse()) {
+            // A writeback of a whole block. Install it without fetching.
+            DPRINTF(DbrcCache, "Allocating writeback %s\n", pkt->print());
+            PacketList writebacks;
+            insert(block_addr, pkt->getConstPtr<uint8_t>(), writebacks, false,
+                   !pkt->hasSharers());
+            M5_VAR_USED bool hit = accessFunctional(pkt);
+            assert(hit);
+            delete pkt;
+            doWritebacks(writebacks);
+            return;
         }
+        assert(pkt->isWrite() || pkt->isRead() || pkt->needsWritable());
+        if (upgrade)
+            stats.upgradeMisses++;
+        MSHR &new_mshr = allocateMSHR(block_addr, pkt->req, lookup_done);
+        new_mshr.needsWritable = pkt->needsWritable();
+        new_mshr.targets.push_back({pkt, port_id, curTick()});
+        updateBlocked();
     }
 }
 
-// Search DBRC for data block
-bool DbrcCache::CacheSearch(Addr block_addr, uint32_t &index)
+void
+DbrcCache::trainPrefetcher(Addr block_addr, RequestorID requestor)
 {
-    uint32_t offset = blockSize/2;
-    
-    // L0T Search
-    if(cache_L0T[block_addr/L0T_offset].V)
-        index = cache_L0T[block_addr/L0T_offset].I;
-    else
-    {
-        index = -1;
-        return false;
+    auto it = prefetchStreams.find(requestor);
+    if (it == prefetchStreams.end()) {
+        prefetchStreams[requestor] = {block_addr, 0, 0, ~uint64_t(0)};
+        return;
     }
 
-    // LNT Search
-    for (size_t i = 1; i < num_BTH; i++) 
-    {
-        BTH_entry* entries = cache_DBA[index].BTH;
-        uint32_t idx = (block_addr/(L0T_offset/(offset))) & (blockSize/2-1);
-        if(entries[idx].V)
-        {
-            index = entries[idx].I;
-            if(cache_DBA[index].dut.R < 32)
-                cache_DBA[index].dut.R++;
+    PrefetchStream &stream = it->second;
+    int64_t stride = ((int64_t)block_addr - (int64_t)stream.lastBlock) /
+                     (int64_t)blockSize;
+    if (stride == 0)
+        return;
+
+    if (stride == stream.stride) {
+        if (stream.confidence < 3)
+            stream.confidence++;
+    } else if (stream.confidence > 0) {
+        stream.confidence--;
+    } else {
+        stream.stride = stride;
+    }
+    stream.lastBlock = block_addr;
+
+    // Wait for the stride to be seen twice in a row
+    if (stream.confidence < 2)
+        return;
+
+    for (unsigned i = 1; i <= prefetchDegree; i++)
+        prefetchBlock(block_addr + stream.stride * i * blockSize, requestor);
+
+    if (prefetchPaths && num_BTH > 1) {
+        // The block at the same offset in the next L0T region in the
+        // direction of the stream. Consecutive blocks of a bank are
+        // numBanks blocks apart.
+        int64_t region_bytes =
+            (int64_t(1) << core.getGeometry().regionShift()) * numBanks;
+        Addr ahead = block_addr +
+                     (stream.stride > 0 ? region_bytes : -region_bytes);
+        uint64_t region = core.getGeometry().region(core.bankAddr(ahead));
+        if (region != stream.pathRegion && inMemory(ahead)) {
+            stream.pathRegion = region;
+            prefetchPath(ahead);
         }
-        else
-            return false;
-        offset *= blockSize/2;
     }
+}
 
-    // Validate data DUT entry
-    if(cache_DBA[index].dut.LF != num_BTH || !cache_DBA[index].dut.V || cache_DBA[index].tt.TAG != block_addr/blockSize)
-    {
-        return false;
+void
+DbrcCache::prefetchBlock(Addr block_addr, RequestorID requestor)
+{
+    // Keep an MSHR for demand misses
+    if (mshrQueue.size() + 1 >= numMSHRs || !writeBufferHasRoom())
+        return;
+    if (!inMemory(block_addr) || findMSHR(block_addr) ||
+        backInvalidations.count(block_addr) || core.isCached(block_addr))
+        return;
+    for (auto wb_pkt : writeBuffer) {
+        if (wb_pkt->getAddr() == block_addr)
+            return;
     }
 
-    return true;
+    DPRINTF(DbrcCache, "Prefetching %#x\n", block_addr);
+    stats.prefetchesIssued++;
+
+    RequestPtr req = std::make_shared<Request>(
+        block_addr, blockSize, Request::PREFETCH, requestor);
+    MSHR &mshr = allocateMSHR(block_addr, req, clockEdge(tlbLatency));
+    mshr.prefetch = true;
+}
+
+void
+DbrcCache::prefetchPath(Addr block_addr)
+{
+    if (!writeBufferHasRoom())
+        return;
+
+    // Nothing to do if the tables are already there
+    if (core.pathDepth(block_addr) >= num_BTH - 1)
+        return;
+
+    PacketList writebacks;
+    uint32_t last_BTH;
+    accessBank(block_addr, perLevelLatency);
+    evictions = &writebacks;
+    unsigned levels = core.installPath(block_addr, num_BTH - 1, last_BTH,
+                                       writeBufferRoom());
+    evictions = nullptr;
+    doWritebacks(writebacks);
+
+    if (levels > 0) {
+        DPRINTF(DbrcCache, "Built %d levels of the path to %#x\n", levels,
+                block_addr);
+        stats.pathPrefetches++;
+    }
+}
+
+bool
+DbrcCache::inMemory(Addr addr) const
+{
+    for (const auto &range : memPort.getAddrRanges()) {
+        if (range.contains(addr))
+            return true;
+    }
+    return false;
 }
 
 /**
  * @brief Check if address exists in cache. Get/Set data if in cache.
  */
 bool
-DbrcCache::accessFunctional(PacketPtr pkt)
+DbrcCache::accessFunctional(PacketPtr pkt, Cycles *lat)
 {
-    uint32_t DBA_index = 0;
     Addr block_addr = pkt->getBlockAddr(blockSize);
-    
-    // TLB Search
-    auto it = cache_TLB.find(block_addr/blockSize);
-    if (it != cache_TLB.end()) {
-        DBA_index = it->second;
-        auto it2 = std::find(cache_TLB_order.begin(), cache_TLB_order.end(), (uint32_t)(block_addr/blockSize));
-        assert(it2 != cache_TLB_order.end());
-        cache_TLB_order.erase(it2);
-        cache_TLB_order.push_back((uint32_t)(block_addr/blockSize));
-    }
-    // Full Cache Search
-    else if(CacheSearch(block_addr, DBA_index))
-    {
-        // Write cache find to TLB
-        if (cache_TLB.size() > TLB_size)
-        {
-            cache_TLB.erase(cache_TLB_order.front());
-            cache_TLB_order.erase(cache_TLB_order.begin());
+    DbrcCore::Lookup lookup = core.lookup(block_addr);
+
+    if (lat) {
+        *lat = tlbLatency + Cycles(perLevelLatency * lookup.levels) +
+               (lookup.found ? dataLatency : Cycles(0));
+        if (lookup.tlbHit) {
+            stats.tlbHits++;
+        } else {
+            stats.tlbMisses++;
+            if (lookup.start > 0)
+                stats.tlbTableHits++;
+            // Every level before the last one read had a valid entry
+            unsigned start = lookup.start, levels = lookup.levels;
+            for (unsigned level = start + 1; level < start + levels; level++)
+                stats.walkHits[level - 1]++;
+            if (lookup.found)
+                stats.walkHits[start + levels - 1]++;
+            else
+                stats.walkMisses[start + levels - 1]++;
         }
-        
-        // TODO: implement storing BTH or data in TLB
-        cache_TLB[block_addr/blockSize] = DBA_index;
-        cache_TLB_order.push_back(block_addr/blockSize);
-    } else
-    {
+    }
+    if (!lookup.found)
         return false;
+
+    if (lat)
+        core.touch(lookup.index);
+    accessBlock(pkt, lookup.index);
+    return true;
+}
+
+void
+DbrcCache::accessBlock(PacketPtr pkt, uint32_t DBA_index)
+{
+    DUT_entry &dut = cache_DBA.dut(DBA_index);
+    if (pkt->fromCache() && pkt->needsResponse()) {
+        // The requestor caches the block from now on. It only gets write
+        // permission if nothing outside holds the block.
+        dut.C = true;
+        if (!pkt->needsWritable() &&
+            (!dut.W || pkt->cmd == MemCmd::ReadCleanReq))
+            pkt->setHasSharers();
     }
 
     // Perform Operation on found cache block
     if (pkt->isWrite()) {
         // Write the data into the block in the cache
-        pkt->writeDataToBlock(cache_DBA[DBA_index].data, blockSize);
-        cache_DBA[DBA_index].dut.D = true;
+        pkt->writeDataToBlock(cache_DBA.data(DBA_index), blockSize);
+        // A clean writeback does not make the block dirty
+        if (!pkt->isCleanEviction())
+            dut.D = true;
     } else if (pkt->isRead()) {
         // Read the data out of the cache block into the packet
-        pkt->setDataFromBlock(cache_DBA[DBA_index].data, blockSize);
-    } else {
+        pkt->setDataFromBlock(cache_DBA.data(DBA_index), blockSize);
+    } else if (!pkt->needsWritable()) {
+        // Upgrades and invalidations only ask for write permission
         panic("Unknown packet type!");
     }
-
-    return true;
 }
 
-/**
- * @brief Insert data in to cache after memory response. Handle write-back and replacement policy.
- * 
- * @details 
- *      1.  b = Select a DBA victim block
- *      2.  Make the BTH entry in level N point to b
- *      3.  if (b's DUT entry bits V==true and PV==true)
- *      3.1     Invalidate the entry of the BTH table that points to b
- *      3.2     Invalidate tan eventual entry in the B-TLB that points to b
- *      3.3     if (b'2 DUT entry LF field indicates the b holds a BTH table)
- *      3.3.1       Invalidate DUT entries associated with b's children
- *      3.4     else if (b's DUT entry dirty bit D==true)
- *      3.4.1       Save b's contents into physical memory
- *      4.  Install block level N+1
- *      5.  if (++N < data block level) goto 1
- */
 void
-DbrcCache::insert(PacketPtr pkt)
+DbrcCache::insert(Addr address, const uint8_t *data, PacketList &writebacks,
+                  bool dirty, bool writable)
 {
-    uint32_t last_BTH, current_level;
-    Addr address = pkt->getAddr();
-
-    // The packet should be aligned.
-    assert(address ==  pkt->getBlockAddr(blockSize));
-    // Address should not be valid in the Cache. Set last valid BTH index.
-    assert(!CacheSearch(address, last_BTH));
-    // The address should not be in the TLB
-    assert(cache_TLB.find(address/blockSize) == cache_TLB.end());
-    // The pkt should be a response
-    assert(pkt->isResponse());
-
+    DPRINTF(DbrcCache, "Inserting %#x\n", address);
+    DDUMP(DbrcCache, data, blockSize);
+
+    // The core writes the dirty blocks it evicts back through the listener
+    assert(!evictions);
+    evictions = &writebacks;
+    uint32_t index;
+    stats.insertLevels.sample(core.insert(address, data, dirty, index,
+                                          writeBufferRoom()));
+    evictions = nullptr;
+
+    cache_DBA.dut(index).W = writable;
+    stats.lockedEntries = core.lockedEntries();
+}
 
-    // Miss in L0T
-    if (last_BTH == -1)
-    {
-        // Invalidate DUT entries associated with b's children
-        if(cache_L0T[address/L0T_offset].V)
-        {
-            cache_DBA[cache_L0T[address/L0T_offset].I].dut.PV = false;
-        }
+void
+DbrcCache::lockRange(Addr start, Addr size)
+{
+    DPRINTF(DbrcCache, "Locking [%#x, %#x)\n", start, start + size);
+    core.lockRange(start, start + size);
+    stats.lockedEntries = core.lockedEntries();
+}
 
-        current_level = 0;
-    }
-    else
-    {
-        current_level = cache_DBA[last_BTH].dut.LF;
+void
+DbrcCache::unlockRange(Addr start, Addr size)
+{
+    if (!core.unlockRange(start, start + size)) {
+        warn("%s: [%#x, %#x) is not locked\n", name(), start, start + size);
+        return;
     }
 
-    current_level++;
+    DPRINTF(DbrcCache, "Unlocked [%#x, %#x)\n", start, start + size);
+    stats.lockedEntries = core.lockedEntries();
+}
 
-    while(current_level <= num_BTH)
-    {
-        size_t i = 0;
-        uint32_t smallest_r_idx = -1;
-        uint32_t smallest_r = 33;
-        // Select DBA vitim block
-        while(i < MNA)
-        {
-            if(!cache_DBA[VBIR].dut.L)
-            {
-                if (!cache_DBA[VBIR].dut.V ||
-                    !cache_DBA[VBIR].dut.PV ||
-                    cache_DBA[VBIR].dut.R == 0)
-                {
-                    break;
-                }
-                else
-                {
-                    if(cache_DBA[VBIR].dut.R < smallest_r)
-                    {
-                        smallest_r_idx = VBIR;
-                        smallest_r = cache_DBA[VBIR].dut.R;
-                    }
-                    cache_DBA[VBIR].dut.R = 0;
-                }
-                i++;
-            }
-            
-            VBIR++;
-            if(VBIR>=capacity)
-                VBIR=0;
-        }
+void
+DbrcCache::evictBlock(uint32_t b)
+{
+    DUT_entry &dut = cache_DBA.dut(b);
+    TT_entry &tt = cache_DBA.tt(b);
 
-        // If b was valid
-        if(cache_DBA[VBIR].dut.V == true && cache_DBA[VBIR].dut.LF > 0)
-        {
-            if(cache_DBA[VBIR].dut.PV == true)
-            {
-                // Invalidate the entry of the BTH table that points to b
-                if(cache_DBA[VBIR].dut.LF == 1)
-                    cache_L0T[cache_DBA[VBIR].tt.PT].V = false;
-                else
-                {
-                    for (i = 0; i < blockSize/2; i++)
-                    {
-                        if (cache_DBA[cache_DBA[VBIR].tt.PT].BTH[i].I == VBIR)
-                        {
-                            cache_DBA[cache_DBA[VBIR].tt.PT].BTH[i].V = false;
-                            break;
-                        }
-                    }
-                }
-            }
+    if (prefetchedBlocks.erase(tt.TAG * blockSize))
+        stats.prefetchesUnused++;
 
-            // If is data, invalidate an entry in the B-TLB that points to b
-            //TODO: BTH in TLB
-            if (cache_DBA[VBIR].dut.LF == num_BTH)
-            {
-                auto it = cache_TLB.find(cache_DBA[VBIR].tt.TAG);
-                if (it != cache_TLB.end()) {
-                    cache_TLB.erase(it);
-                    auto it2 = std::find(cache_TLB_order.begin(), cache_TLB_order.end(), (uint32_t)(cache_DBA[VBIR].tt.TAG));
-                    assert(it2 != cache_TLB_order.end());
-                    cache_TLB_order.erase(it2);
-                }
-                cache_DBA[VBIR].tt.TAG = 0;
-            }
+    // Keep the caches above inclusive. They may have newer data.
+    if (dut.C)
+        backInvalidate(b);
 
-            // if (b's DUT entry LF field indicates the b holds a BTH table)
-            if(cache_DBA[VBIR].dut.LF < num_BTH)
-            {
-                for (i = 0; i < blockSize/2; i++)
-                {
-                    // Invalidate DUT entries associated with b's children
-                    if(((BTH_entry*)(cache_DBA[VBIR].BTH))[i].V)
-                    {
-                        cache_DBA[((BTH_entry*)(cache_DBA[VBIR].BTH))[i].I].dut.PV = false;
-                    }
-                }
-            }
-            // else if (b's DUT entry dirty bit D==true)
-            else if(cache_DBA[VBIR].dut.D)
-            {
-                // Save b's contents into physical memory
-                // Create a new request-packet pair
-                RequestPtr req = std::make_shared<Request>(
-                    cache_DBA[VBIR].tt.TAG, blockSize, 0, 0);
-
-                PacketPtr new_pkt = new Packet(req, MemCmd::WritebackDirty, blockSize);
-                new_pkt->dataDynamic(cache_DBA[VBIR].data); // This will be deleted later
-
-                DPRINTF(DbrcCache, "Writing packet back %s\n", pkt->print());
-                // Send the write to memory
-                memPort.sendPacket(new_pkt);
-            }
-        }
+    if (dut.D)
+    {
+        // Save b's contents into physical memory
+        // Create a new request-packet pair
+        RequestPtr req = std::make_shared<Request>(
+            tt.TAG * blockSize, blockSize, 0, 0);
+
+        PacketPtr new_pkt = new Packet(req, MemCmd::WritebackDirty,
+                                       blockSize);
+        // Copy the block, it is about to be reused
+        new_pkt->allocate();
+        new_pkt->setData(cache_DBA.data(b));
+        // The block may be shared outside, it was only Owned
+        if (!dut.W)
+            new_pkt->setHasSharers();
+
+        stats.writebacks++;
+        stats.writebackBytes += blockSize;
+        panic_if(!evictions, "Dirty block evicted outside of an insert");
+        evictions->push_back(new_pkt);
+    }
+}
 
-        // Select smallest R value if no suitable found in Maximum Number of Attempts
-        if(i == MNA)
-            VBIR = smallest_r_idx;
-        
-        if (current_level == 1)
-        {
-            // Make the BTH entry in L0T point to b and set valid
-            cache_L0T[address/L0T_offset].I = VBIR;
-            cache_L0T[address/L0T_offset].V = true;
-        }
-        else
-        {
-            // Make the BTH entry in level N point to b and set valid
-            cache_DBA[last_BTH].BTH[(address/(uint32_t)(L0T_offset/pow(blockSize/2, current_level-1)))&(blockSize/2-1)].I = VBIR;
-            cache_DBA[last_BTH].BTH[(address/(uint32_t)(L0T_offset/pow(blockSize/2, current_level-1)))&(blockSize/2-1)].V = true;
-        }    
-
-        // Install block level N+1
-        // Clear data memory
-        std::memset(cache_DBA[VBIR].data, 0, blockSize*sizeof(uint8_t));
-        std::memset(cache_DBA[VBIR].BTH, 0, blockSize/2*sizeof(BTH_entry));
-        
-        cache_DBA[VBIR].dut.V = true;
-        cache_DBA[VBIR].dut.PV = true;
-        cache_DBA[VBIR].dut.LF = current_level;
-        cache_DBA[VBIR].dut.R = 1;
-        if (current_level == 1)
-            cache_DBA[VBIR].tt.PT = address/L0T_offset;
+void
+DbrcCache::CoreListener::victimSelected(
+    uint32_t index, const DbrcReplacement::Victim &victim)
+{
+    owner->stats.victimScanLength.sample(victim.attempts);
+    if (victim.fallback)
+        owner->stats.victimScansExhausted++;
+
+    const DUT_entry &dut = owner->cache_DBA.dut(index);
+    if (dut.V && dut.LF > 0) {
+        if (dut.LF < owner->num_BTH)
+            owner->stats.tableVictims++;
         else
-            cache_DBA[VBIR].tt.PT = last_BTH;
-
-        last_BTH = VBIR;
-        current_level++;
-        VBIR++;
-        if(VBIR>=capacity)
-        {
-            VBIR=0;
-        }
-
-        // if (++N < data block level) goto 1
+            owner->stats.dataVictims++;
     }
+}
 
-    // DPRINTF(DbrcCache, "Inserting %s\n", pkt->print());
-    // DDUMP(DbrcCache, pkt->getConstPtr<uint8_t>(), blockSize);
+void
+DbrcCache::CoreListener::blockEvicted(uint32_t index)
+{
+    owner->evictBlock(index);
+}
 
+void
+DbrcCache::CoreListener::entryDropped(uint32_t index)
+{
+    owner->stats.droppedEntries++;
+}
 
-    DPRINTF(DbrcCache, "Inserting %s\n", pkt->print());
-    DDUMP(DbrcCache, pkt->getConstPtr<uint8_t>(), blockSize);
+void
+DbrcCache::CoreListener::tlbEvicted()
+{
+    owner->stats.tlbEvictions++;
+}
 
-    cache_DBA[last_BTH].tt.TAG = address/blockSize;
+void
+DbrcCache::CoreListener::lockRefused(uint32_t index)
+{
+    DPRINTFS(DbrcCache, owner, "Not locking %#x, bank %d is full of locked "
+             "entries\n", owner->cache_DBA.tt(index).TAG * owner->blockSize,
+             index / owner->entriesPerBank);
+    owner->stats.lockRefusals++;
+}
 
-    // Write cache find to TLB
-    if (cache_TLB.size() > TLB_size)
-    {
-        cache_TLB.erase(cache_TLB_order.front());
-        cache_TLB_order.erase(cache_TLB_order.begin());
+void
+DbrcCache::invalidateBlock(uint32_t b)
+{
+    DUT_entry &dut = cache_DBA.dut(b);
+    DPRINTF(DbrcCache, "Invalidating %#x\n", cache_DBA.tt(b).TAG * blockSize);
+    stats.snoopInvalidations++;
+
+    // The snoop took care of the data and of the caches above, nothing is
+    // written back
+    dut.D = false;
+    dut.C = false;
+    core.invalidate(b);
+    stats.lockedEntries = core.lockedEntries();
+}
+
+void
+DbrcCache::backInvalidate(uint32_t b)
+{
+    DUT_entry &dut = cache_DBA.dut(b);
+    Addr block_addr = cache_DBA.tt(b).TAG * blockSize;
+    DPRINTF(DbrcCache, "Back-invalidating %#x\n", block_addr);
+    stats.backInvalidationsSent++;
+    dut.C = false;
+
+    // Snoop as for a write, a cache above with the block dirty responds
+    // with the data
+    RequestPtr req = std::make_shared<Request>(block_addr, blockSize, 0, 0);
+    Packet snoop_pkt(req, MemCmd::ReadExReq, blockSize);
+    snoop_pkt.allocate();
+
+    if (system->isTimingMode()) {
+        snoop_pkt.setExpressSnoop();
+        snoopUp(&snoop_pkt, true);
+        if (snoop_pkt.cacheResponding()) {
+            // The data is written back once it arrives
+            backInvalidations[block_addr] = {req, dut.W, {}};
+        }
+    } else {
+        snoopUp(&snoop_pkt, false);
+        if (snoop_pkt.cacheResponding()) {
+            std::memcpy(cache_DBA.data(b), snoop_pkt.getConstPtr<uint8_t>(),
+                        blockSize);
+            dut.D = true;
+            stats.backInvalidationsDirty++;
+        }
     }
+}
 
-    cache_TLB[address/blockSize] = last_BTH;
-    cache_TLB_order.push_back(address/blockSize);
+void
+DbrcCache::doWritebacks(PacketList &writebacks)
+{
+    // The insert that caused these only replaced the tables whose subtree
+    // fit in the room left
+    panic_if(writeBuffer.size() + writebacks.size() > numWriteBuffers,
+             "Write buffer overflow");
+    writeBuffer.insert(writeBuffer.end(), writebacks.begin(),
+                       writebacks.end());
+    writebacks.clear();
+
+    sendWritebacks();
+}
 
-    // Write the data into the cache
-    pkt->writeDataToBlock(cache_DBA[last_BTH].data, blockSize);
+void
+DbrcCache::doWritebacksAtomic(PacketList &writebacks)
+{
+    while (!writebacks.empty()) {
+        PacketPtr wb_pkt = writebacks.front();
+        writebacks.pop_front();
+
+        DPRINTF(DbrcCache, "Writing packet back atomically %s\n",
+                wb_pkt->print());
+        // Writebacks are off of the critical path, ignore their latency
+        memPort.sendAtomic(wb_pkt);
+        delete wb_pkt;
+    }
 }
 
 AddrRangeList
@@ -677,11 +2133,98 @@ DbrcCache::DbrcCacheStats::DbrcCacheStats(Stats::Group *parent)
       : Stats::Group(parent),
       ADD_STAT(hits, "Number of hits"),
       ADD_STAT(misses, "Number of misses"),
+      ADD_STAT(mshrHits,
+               "Number of misses coalesced into an outstanding MSHR"),
+      ADD_STAT(splitAccesses,
+               "Number of accesses split because they span several blocks"),
+      ADD_STAT(blockedNoMSHRs,
+               "Number of times the cache blocked with no free MSHR"),
+      ADD_STAT(bankAccesses, "Number of accesses to each bank"),
+      ADD_STAT(bankConflicts,
+               "Number of accesses that waited for a busy bank"),
+      ADD_STAT(blockedNoWBuffers,
+               "Number of times the cache blocked with the write buffer full"),
+      ADD_STAT(writebacks, "Number of dirty blocks written back"),
+      ADD_STAT(writebackBytes, "Bytes written back to memory"),
+      ADD_STAT(writeBufferHits,
+               "Number of misses served from the write buffer"),
+      ADD_STAT(writeBufferOccupancy,
+               "Average number of writebacks in the write buffer"),
+      ADD_STAT(writebackBandwidth, "Writeback bandwidth (bytes/s)",
+               writebackBytes / simSeconds),
+      ADD_STAT(tlbHits, "Number of lookups that hit in the B-TLB"),
+      ADD_STAT(tlbMisses, "Number of lookups that missed in the B-TLB"),
+      ADD_STAT(tlbTableHits,
+               "Number of walks started at a table found in the B-TLB"),
+      ADD_STAT(tlbEvictions,
+               "Number of B-TLB entries replaced to make room for another"),
+      ADD_STAT(tlbHitRatio, "The ratio of B-TLB hits to B-TLB lookups",
+               tlbHits / (tlbHits + tlbMisses)),
+      ADD_STAT(walkHits,
+               "Number of walks that found a valid entry at each level"),
+      ADD_STAT(walkMisses, "Number of walks that stopped at each level"),
+      ADD_STAT(insertLevels, "Number of levels installed per insert"),
+      ADD_STAT(tableVictims, "Number of valid BTH tables replaced"),
+      ADD_STAT(dataVictims, "Number of valid data blocks replaced"),
+      ADD_STAT(droppedEntries, "Number of entries dropped along with a "
+               "replaced table above them"),
+      ADD_STAT(victimScanLength,
+               "Number of replaceable entries examined per victim search"),
+      ADD_STAT(victimScansExhausted,
+               "Number of victim searches that used up MNA attempts"),
+      ADD_STAT(lockedEntries, "Average number of locked DBA entries"),
+      ADD_STAT(lockRefusals,
+               "Number of blocks not locked because too many entries were"),
+      ADD_STAT(upgradeMisses, "Number of accesses that needed write "
+               "permission for a block the cache only had shared"),
+      ADD_STAT(uncacheableAccesses,
+               "Number of uncacheable accesses forwarded to memory"),
+      ADD_STAT(snoops, "Number of snoops from the memory side"),
+      ADD_STAT(snoopHits, "Number of snoops that found the block"),
+      ADD_STAT(snoopResponses,
+               "Number of snoops answered with a dirty block"),
+      ADD_STAT(snoopsDeferred, "Number of snoops answered once the data "
+               "of an outstanding fill or back-invalidation arrived"),
+      ADD_STAT(snoopInvalidations, "Number of blocks invalidated by snoops"),
+      ADD_STAT(backInvalidationsSent, "Number of replaced blocks "
+               "invalidated in the caches above"),
+      ADD_STAT(backInvalidationsDirty, "Number of back-invalidations a "
+               "cache above answered with dirty data"),
+      ADD_STAT(portRequests,
+               "Number of requests granted from each CPU side port"),
+      ADD_STAT(portRefusals, "Number of requests refused because the "
+               "input queue of the port was full"),
+      ADD_STAT(portQueueLatency, "Ticks the granted requests of each port "
+               "waited in its input queue"),
+      ADD_STAT(avgPortQueueLatency, "Average ticks a granted request of "
+               "each port waited in its input queue",
+               portQueueLatency / portRequests),
+      ADD_STAT(prefetchesIssued, "Number of blocks prefetched"),
+      ADD_STAT(prefetchesUseful,
+               "Number of prefetched blocks hit by a demand access"),
+      ADD_STAT(prefetchesLate, "Number of prefetches a demand access "
+               "missed on before the block arrived"),
+      ADD_STAT(prefetchesUnused,
+               "Number of prefetched blocks evicted before being used"),
+      ADD_STAT(pathPrefetches,
+               "Number of paths of the next region built ahead of a stream"),
+      ADD_STAT(prefetchAccuracy,
+               "The ratio of prefetches that were used to prefetches issued",
+               (prefetchesUseful + prefetchesLate) / prefetchesIssued),
+      ADD_STAT(prefetchCoverage,
+               "The ratio of misses the prefetcher avoided",
+               prefetchesUseful / (prefetchesUseful + misses)),
+      ADD_STAT(tracedAccesses, "Number of block accesses recorded in the "
+               "trace"),
+      ADD_STAT(traceStalls, "Number of times recording waited for the "
+               "trace writer to catch up"),
+      ADD_STAT(hitLatency, "Ticks for hits to the cache"),
       ADD_STAT(missLatency, "Ticks for misses to the cache"),
       ADD_STAT(hitRatio,
                "The ratio of hits to the total accesses to the cache",
                hits / (hits + misses))
 {
+    hitLatency.init(16); // number of buckets
     missLatency.init(16); // number of buckets
 }
 
@@ -1,49 +1,37 @@
 #ifndef __LEARNING_GEM5_TEST_CACHE_HH__
 #define __LEARNING_GEM5_TEST_CACHE_HH__
 
+#include <deque>
+#include <list>
+#include <memory>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "base/statistics.hh"
+#include "learning_gem5/mine/dbrc_core.hh"
+#include "learning_gem5/mine/dbrc_dba.hh"
+#include "learning_gem5/mine/dbrc_entries.hh"
+#include "learning_gem5/mine/dbrc_tlb.hh"
+#include "learning_gem5/mine/dbrc_trace.hh"
 #include "mem/port.hh"
+#include "enums/DbrcArbitration.hh"
+#include "enums/DbrcReplacementPolicy.hh"
 #include "params/DbrcCache.hh"
 #include "sim/clocked_object.hh"
-
-typedef struct
-{
-  bool V;
-  uint32_t I;
-} BTH_entry;
-
-typedef struct 
-{
-  bool V;
-  bool D;
-  bool L;
-  uint8_t LF;
-  bool PV;
-  uint8_t R;
-} DUT_entry;
-
-typedef struct
-{
-  uint32_t TAG;
-  uint8_t PT;
-} TT_entry;
-
-typedef struct
-{
-  BTH_entry* BTH;
-  uint8_t* data;
-  DUT_entry dut;
-  TT_entry tt;
-} DBA_entry;
+#include "sim/system.hh"
 
 /**
- * A very simple cache object. Has a fully-associative data store with random
- * replacement.
- * This cache is fully blocking (not non-blocking). Only a single request can
- * be outstanding at a time.
+ * A dynamic block region cache (DBRC). Blocks are found by walking a tree of
+ * block table (BTH) levels rooted in the L0T, with a B-TLB short-cutting the
+ * walk for recently used data blocks.
+ * This cache is non-blocking. Misses are tracked in a file of MSHRs and
+ * further accesses to a block that is already being fetched are coalesced
+ * into its MSHR.
  * This cache is a writeback cache.
+ * The cache takes part in the coherence protocol of the classic memory
+ * system. It is inclusive of the caches above: they are snooped when a
+ * block they may hold is replaced. Snoops from the memory side are
+ * forwarded to them when they may hold the block.
  */
 class DbrcCache : public ClockedObject
 {
@@ -65,21 +53,22 @@ class DbrcCache : public ClockedObject
         /// True if the port needs to send a retry req.
         bool needRetry;
 
-        /// If we tried to send a packet and it was blocked, store it here
-        PacketPtr blockedPacket;
+        /// Responses that could not be sent yet, oldest first. The cache can
+        /// have several responses in flight to the same port.
+        std::deque<PacketPtr> blockedPackets;
 
       public:
         /**
          * Constructor. Just calls the superclass constructor.
          */
         CPUSidePort(const std::string& name, int id, DbrcCache *owner) :
-            ResponsePort(name, owner), id(id), owner(owner), needRetry(false),
-            blockedPacket(nullptr)
+            ResponsePort(name, owner), id(id), owner(owner), needRetry(false)
         { }
 
         /**
          * Send a packet across this port. This is called by the owner and
-         * all of the flow control is hanled in this function.
+         * all of the flow control is hanled in this function. If the port
+         * is blocked the packet is queued behind the earlier responses.
          * This is a convenience function for the DbrcCache to send pkts.
          *
          * @param packet to send.
@@ -97,17 +86,23 @@ class DbrcCache : public ClockedObject
 
         /**
          * Send a retry to the peer port only if it is needed. This is called
-         * from the DbrcCache whenever it is unblocked.
+         * from the DbrcCache whenever a request leaves the input queue of
+         * the port or a response is sent.
          */
         void trySendRetry();
 
+        /// True if responses are waiting for a retry from the peer
+        bool isBlocked() const { return !blockedPackets.empty(); }
+
       protected:
         /**
          * Receive an atomic request packet from the request port.
-         * No need to implement in this simple cache.
+         * The access is completed, including any fill, before returning.
+         *
+         * @param packet the requestor sent.
+         * @return estimated latency of the access
          */
-        Tick recvAtomic(PacketPtr pkt) override
-        { panic("recvAtomic unimpl."); }
+        Tick recvAtomic(PacketPtr pkt) override;
 
         /**
          * Receive a functional request packet from the request port.
@@ -118,7 +113,8 @@ class DbrcCache : public ClockedObject
         void recvFunctional(PacketPtr pkt) override;
 
         /**
-         * Receive a timing request from the request port.
+         * Receive a timing request from the request port. The request waits
+         * in the input queue of the port until the arbiter grants it.
          *
          * @param the packet that the requestor sent
          * @return whether this object can consume to packet. If false, we
@@ -133,6 +129,12 @@ class DbrcCache : public ClockedObject
          * port) and was unsuccessful.
          */
         void recvRespRetry() override;
+
+        /**
+         * Receive the response of a cache above to a snoop, either one
+         * forwarded from the memory side or a back-invalidation.
+         */
+        bool recvTimingSnoopResp(PacketPtr pkt) override;
     };
 
     /**
@@ -148,6 +150,9 @@ class DbrcCache : public ClockedObject
         /// If we tried to send a packet and it was blocked, store it here
         PacketPtr blockedPacket;
 
+        /// Snoop responses that could not be sent yet, oldest first
+        std::deque<PacketPtr> blockedSnoopResps;
+
       public:
         /**
          * Constructor. Just calls the superclass constructor.
@@ -165,6 +170,26 @@ class DbrcCache : public ClockedObject
          */
         void sendPacket(PacketPtr pkt);
 
+        /// True if a packet is waiting for a retry from the peer
+        bool isBlocked() const { return blockedPacket != nullptr; }
+
+        /// True if the packet waiting for a retry is to a block
+        bool
+        isBlockedOn(Addr block_addr) const
+        {
+            return blockedPacket && blockedPacket->getAddr() == block_addr;
+        }
+
+        /**
+         * Send a snoop response, behind the ones that are already waiting
+         * for a retry.
+         */
+        void sendSnoopResp(PacketPtr pkt);
+
+        /// True if snoop responses are waiting for a retry from the peer
+        bool hasBlockedSnoopResps() const
+        { return !blockedSnoopResps.empty(); }
+
       protected:
         /**
          * Receive a timing response from the response port.
@@ -186,11 +211,175 @@ class DbrcCache : public ClockedObject
          * interconnect component like a bus.
          */
         void recvRangeChange() override;
+
+        /// The memory side snoops the cache, it may hold dirty blocks
+        bool isSnooping() const override { return true; }
+
+        /// Receive a snoop from the memory side
+        void recvTimingSnoopReq(PacketPtr pkt) override;
+        Tick recvAtomicSnoop(PacketPtr pkt) override;
+        void recvFunctionalSnoop(PacketPtr pkt) override;
+
+        /// Send the snoop responses that were refused
+        void recvRetrySnoopResp() override;
+    };
+
+    /**
+     * Keeps the statistics of the DBRC core and writes back the dirty
+     * blocks it evicts.
+     */
+    class CoreListener : public DbrcCoreListener
+    {
+      private:
+        /// The object that owns this object (DbrcCache)
+        DbrcCache *owner;
+
+      public:
+        CoreListener(DbrcCache *owner) : owner(owner) { }
+
+        void victimSelected(uint32_t index,
+                            const DbrcReplacement::Victim &victim) override;
+        void blockEvicted(uint32_t index) override;
+        void entryDropped(uint32_t index) override;
+        void tlbEvicted() override;
+        void lockRefused(uint32_t index) override;
     };
 
     /**
-     * Handle the request from the CPU side. Called from the CPU port
-     * on a timing request.
+     * State shared by the parts of an access that spans several blocks.
+     * The original packet is responded to once the last part is done.
+     */
+    struct SplitAccess : public Packet::SenderState
+    {
+        SplitAccess(PacketPtr pkt, unsigned parts) :
+            pkt(pkt), outstanding(parts)
+        { }
+
+        /// The original access
+        PacketPtr pkt;
+
+        /// Parts that are not done yet
+        unsigned outstanding;
+    };
+
+    /// An uncacheable access forwarded to the memory side as it is
+    struct UncacheableAccess : public Packet::SenderState
+    {
+        UncacheableAccess(int port_id) : portId(port_id) { }
+
+        /// The port to send the response to
+        int portId;
+    };
+
+    /**
+     * Miss status holding register. Tracks one outstanding block fill and
+     * every access that is waiting for that block.
+     */
+    struct MSHR
+    {
+        /// An access waiting for the block to arrive
+        struct Target
+        {
+            PacketPtr pkt;
+            /// The port to send the response to
+            int portId;
+            /// When the access was received, for the miss latency
+            Tick recvTime;
+        };
+
+        /// Block aligned address being fetched
+        Addr blockAddr;
+
+        /// Request the fill is sent for
+        RequestPtr req;
+
+        /// True while no demand access waits for the block
+        bool prefetch;
+
+        /// True if the block is fetched with write permission. A block
+        /// already in the cache is only made writable.
+        bool needsWritable;
+
+        /// Earliest tick the fill can be sent to memory
+        Tick readyTime;
+
+        /// True once the fill request has been sent to memory
+        bool inService;
+
+        /// Accesses to the block in the order they were received
+        std::vector<Target> targets;
+
+        /// Snoops ordered after the fill, answered once it is back
+        std::vector<PacketPtr> deferredSnoops;
+
+        /// Set if a snoop another cache answers was ordered after the
+        /// fill. The targets are serviced, then the block is invalidated,
+        /// respectively made not writable.
+        bool postInvalidate;
+        bool postDowngrade;
+    };
+
+    /**
+     * A replaced block a cache above holds dirty. The block is written
+     * back once its data comes back.
+     */
+    struct BackInvalidation
+    {
+        /// Request of the snoop, to recognize its response
+        RequestPtr req;
+
+        /// True if the block was writable when it was replaced
+        bool writable;
+
+        /// Snoops from the memory side waiting for the data. The first one
+        /// takes the ownership of the block, so nothing is written back.
+        std::vector<PacketPtr> deferredSnoops;
+    };
+
+    /// Timing requests of a CPU side port waiting for the arbiter
+    struct InputQueue
+    {
+        /// Requests with the tick they arrived, oldest first
+        std::deque<std::pair<PacketPtr, Tick>> requests;
+
+        /// Grants left in the current turn of the port
+        unsigned credit;
+    };
+
+    /**
+     * Queue a timing request of a CPU side port and make sure the arbiter
+     * runs.
+     *
+     * @return false if the input queue of the port is full
+     */
+    bool queueRequest(PacketPtr pkt, int port_id);
+
+    /// Run the arbiter in this tick, if it is not scheduled yet
+    void scheduleArbitration();
+
+    /**
+     * Grant the queued requests to the cache, one at a time, until every
+     * queue is empty or the cache refused the head of each of them. A
+     * refused port is only tried again the next time the arbiter runs.
+     */
+    void arbitrate();
+
+    /**
+     * Pick the port to grant next. The ports take turns in round robin
+     * order. Under weighted QoS a turn lasts as many grants as the weight
+     * of the requestor at the head of the queue, otherwise one.
+     *
+     * @param refused ports whose head was refused in this pass
+     * @return the port, or -1 if no port can be granted
+     */
+    int selectPort(const std::vector<bool> &refused);
+
+    /// Grants per turn of a port whose head request is from a requestor
+    unsigned requestorWeight(RequestorID requestor) const;
+
+    /**
+     * Handle the request from the CPU side. Called from the arbiter when
+     * it grants a timing request.
      *
      * @param requesting packet
      * @param id of the port to send the response
@@ -199,6 +388,50 @@ class DbrcCache : public ClockedObject
      */
     bool handleRequest(PacketPtr pkt, int port_id);
 
+    /**
+     * Handle a request a cache above has committed to respond to. The
+     * copies outside this cache and the caches above are invalidated if
+     * the responder does not give write permission.
+     *
+     * @return latency of the invalidation, in atomic mode
+     */
+    Tick handleCacheResponding(PacketPtr pkt, bool is_timing);
+
+    /**
+     * Handle a snoop from the memory side. The caches above are snooped
+     * first if they may hold the block. The cache responds if it holds the
+     * block dirty, and drops or shares it as the snoop requires. A snoop
+     * ordered after a fill that brings the block modified is answered once
+     * the fill is back.
+     *
+     * @return latency of the snoop, in atomic mode
+     */
+    Tick handleSnoop(PacketPtr pkt, bool is_timing);
+
+    /// Handle a functional snoop from the memory side
+    void handleFunctionalSnoop(PacketPtr pkt);
+
+    /**
+     * Handle the response of a cache above to a snoop. Responses to
+     * back-invalidations are sunk here, the others are forwarded to the
+     * memory side.
+     */
+    void handleSnoopResponse(PacketPtr pkt);
+
+    /**
+     * Snoop the caches above through every CPU side port they snoop.
+     *
+     * @return latency of the snoop, in atomic mode
+     */
+    Tick snoopUp(PacketPtr pkt, bool is_timing);
+
+    /**
+     * Respond to a snoop from the memory side with a block, after a delay
+     * in timing mode.
+     */
+    void supplySnoopResponse(PacketPtr pkt, const uint8_t *data,
+                             bool is_timing, Tick when);
+
     /**
      * Handle the respone from the memory side. Called from the memory port
      * on a timing response.
@@ -212,44 +445,263 @@ class DbrcCache : public ClockedObject
     /**
      * Send the packet to the CPU side.
      * This function assumes the pkt is already a response packet and forwards
-     * it to the correct port. This function also unblocks this object and
-     * cleans up the whole request.
+     * it to the correct port. A part of a split access is retired instead,
+     * and the original access is sent after its last part.
      *
      * @param the packet to send to the cpu side
+     * @param id of the port to send the response
+     */
+    void sendResponse(PacketPtr pkt, int port_id);
+
+    /**
+     * Find the MSHR tracking a block.
+     *
+     * @param block aligned address
+     * @return the MSHR or nullptr if the block is not being fetched
      */
-    void sendResponse(PacketPtr pkt);
+    MSHR *findMSHR(Addr block_addr);
+
+    /**
+     * Allocate an MSHR for a block, without targets. The fill is sent to
+     * memory once the lookup is done.
+     *
+     * @param req request of the first access to the block
+     * @param ready tick the lookup that missed is done
+     */
+    MSHR &allocateMSHR(Addr block_addr, const RequestPtr &req, Tick ready);
+
+    /**
+     * Stream of blocks accessed by one requestor, as seen by the
+     * prefetcher.
+     */
+    struct PrefetchStream
+    {
+        /// Last block accessed
+        Addr lastBlock;
+
+        /// Distance between the last accesses, in blocks
+        int64_t stride;
+
+        /// Number of times the stride was confirmed, saturating
+        unsigned confidence;
+
+        /// L0T region whose path was built ahead last
+        uint64_t pathRegion;
+    };
+
+    /**
+     * Train the prefetcher with a demand access. Once the stride of the
+     * requestor is confirmed, fetch the next prefetch_degree blocks of the
+     * stream and build the path of the next L0T region ahead of it.
+     */
+    void trainPrefetcher(Addr block_addr, RequestorID requestor);
+
+    /**
+     * Fetch a block that is not in the cache yet. Dropped when it is
+     * already being fetched or when the MSHRs or the write buffer are
+     * getting full, demand misses go first.
+     */
+    void prefetchBlock(Addr block_addr, RequestorID requestor);
+
+    /**
+     * Install the tables on the path to a block, but not the block itself,
+     * so that a later miss only has to install the data block.
+     */
+    void prefetchPath(Addr block_addr);
+
+    /// True if an address is backed by the memory side, i.e. can be fetched
+    bool inMemory(Addr addr) const;
+
+    /**
+     * Start an access in the lookup pipeline of the bank of a block. A bank
+     * starts one access per cycle while the earlier ones are still in
+     * flight. An access that has to wait for the next cycle is counted as
+     * a conflict.
+     *
+     * @param lat cycles the access takes once started
+     * @return tick the access is done
+     */
+    Tick accessBank(Addr block_addr, Cycles lat);
+
+    /**
+     * Send the fill requests of all ready MSHRs that have not been sent
+     * yet. Stops early if the memory side port is blocked, in which case it
+     * is called again on the retry.
+     */
+    void sendMSHRFills();
+
+    /**
+     * Send the writebacks waiting in the write buffer, oldest first, until
+     * the memory side port is blocked. Retry a refused fill response once
+     * there is room.
+     */
+    void sendWritebacks();
+
+    /**
+     * True if the write buffer can take the writebacks of one more insert.
+     * An insert writes back at most writeBufferRoom() blocks: it replaces
+     * a table only if the dirty blocks of its subtree fit, keeping room
+     * for the num_BTH blocks it may replace.
+     */
+    bool writeBufferHasRoom() const;
+
+    /// Free write buffers
+    unsigned writeBufferRoom() const;
+
+    /**
+     * Move a block that was evicted but not written back yet from the
+     * write buffer back into the cache.
+     *
+     * @return true if the block was in the write buffer
+     */
+    bool reclaimWriteback(Addr block_addr);
+
+    /**
+     * Block the CPU side if the MSHR file (or the targets of an MSHR) or the
+     * write buffer is exhausted. Unblock and send retries once there is
+     * room again.
+     */
+    void updateBlocked();
+
+    /**
+     * True if there is no outstanding miss and no response or writeback
+     * waiting to be sent, i.e. the state can be checkpointed.
+     */
+    bool isDrained() const;
+
+    /// Tell the drain manager we are done once the last packet has left
+    void tryDrainDone();
+
+    /// Number of blocks an access touches
+    unsigned blocksSpanned(PacketPtr pkt) const;
+
+    /**
+     * Split an access that spans several blocks into one access per block.
+     * The parts read and write the data of the original packet in place.
+     *
+     * @return the parts, in address order
+     */
+    std::vector<PacketPtr> splitPacket(PacketPtr pkt) const;
+
+    /**
+     * Access the cache for a timing access that spans several blocks. The
+     * parts are looked up in parallel, each hitting or missing on its own,
+     * as long as there is room for them. The others wait in splitParts.
+     */
+    void splitTiming(PacketPtr pkt, int port_id);
+
+    /**
+     * Access the cache for the parts of a split access that are waiting,
+     * in order, until the cache blocks.
+     */
+    void issueSplitParts();
+
+    /**
+     * Handle a packet atomically. Look up the block, fetch and install it
+     * from memory on a miss and perform the access. Used when running with
+     * atomic CPUs, e.g. to warm up the cache before switching to timing.
+     *
+     * @param packet to access, turned into a response if it needs one
+     * @param id of the port it came from
+     * @return latency of the levels walked plus the memory latency on a miss
+     */
+    Tick handleAtomic(PacketPtr pkt, int port_id);
 
     /**
      * Handle a packet functionally. Update the data on a write and get the
      * data on a read. Called from CPU port on a recv functional.
      *
      * @param packet to functionally handle
+     * @param id of the port it came from
      */
-    void handleFunctional(PacketPtr pkt);
+    void handleFunctional(PacketPtr pkt, int port_id);
 
     /**
-     * Access the cache for a timing access. This is called after the cache
-     * access latency has already elapsed.
+     * Add an access to the trace, if one is being recorded, one record per
+     * block it spans.
      */
-    void accessTiming(PacketPtr pkt);
+    void recordAccess(PacketPtr pkt, int port_id);
+
+    /// Write the rest of the trace out, at the end of the simulation
+    void closeTrace();
 
-    bool CacheSearch(Addr block_addr, uint32_t &index);
+    /**
+     * Access the cache for a timing access. Hits are responded to after the
+     * lookup latency, which depends on how deep the walk went. Misses are
+     * either coalesced into the MSHR already fetching the block or
+     * allocate a new MSHR.
+     */
+    void accessTiming(PacketPtr pkt, int port_id);
 
     /**
      * This is where we actually update / read from the cache. This function
-     * is executed on both timing and functional accesses.
+     * is executed on timing and atomic accesses. The lookup maps the block
+     * in the TLB and the walk increments R in the tables it reads.
+     * Functional accesses go to accessBlock() directly so that they leave
+     * that state alone.
+     *
+     * @param lat if not null, set to the lookup latency: the TLB access,
+     *        the tables read when the TLB misses and, on a hit, the data
+     *        block access. The lookup then counts in the stats and the
+     *        block is touched in the replacement policy.
      *
      * @return true if a hit, false otherwise
      */
-    bool accessFunctional(PacketPtr pkt);
+    bool accessFunctional(PacketPtr pkt, Cycles *lat = nullptr);
+
+    /// Read or write the block in a DBA entry for a packet
+    void accessBlock(PacketPtr pkt, uint32_t index);
+
+    /**
+     * Insert a block into the cache. The core replaces entries to make
+     * room for the block and the tables of its path.
+     *
+     * @param block aligned address to insert into the cache
+     * @param data of the whole block
+     * @param writebacks list the dirty blocks evicted are added to
+     * @param dirty true if data is newer than the copy in memory
+     * @param writable false if the block may be cached outside this cache
+     *        and the caches above
+     */
+    void insert(Addr address, const uint8_t *data, PacketList &writebacks,
+                bool dirty = false, bool writable = true);
 
     /**
-     * Insert a block into the cache. If there is no room left in the cache,
-     * then this function evicts a random entry t make room for the new block.
+     * Drop a block a snoop invalidated. Nothing is written back, the snoop
+     * took care of the caches above and of the data.
+     */
+    void invalidateBlock(uint32_t b);
+
+    /**
+     * Invalidate a replaced block in the caches above. In atomic mode the
+     * dirty data of a cache above is written into the block. In timing
+     * mode it is written back once it arrives.
+     */
+    void backInvalidate(uint32_t b);
+
+    /**
+     * A data block is leaving the core. Invalidate it in the caches above
+     * and write it back if it is dirty, to the list of the insert that
+     * replaced it.
      *
-     * @param packet with the data (and address) to insert into the cache
+     * @param index of the DBA entry
      */
-    void insert(PacketPtr pkt);
+    void evictBlock(uint32_t b);
+
+    /**
+     * Queue the writebacks of evicted blocks in the write buffer and send
+     * them to memory in timing mode.
+     *
+     * @param writebacks to send, the list is emptied
+     */
+    void doWritebacks(PacketList &writebacks);
+
+    /**
+     * Send the writebacks of evicted blocks to memory in atomic mode.
+     *
+     * @param writebacks to send, the list is emptied
+     */
+    void doWritebacksAtomic(PacketList &writebacks);
 
     /**
      * Return the address ranges this cache is responsible for. Just use the
@@ -264,8 +716,14 @@ class DbrcCache : public ClockedObject
      */
     void sendRangeChange() const;
 
-    /// Latency to check the cache. Number of cycles for both hit and miss
-    const Cycles latency;
+    /// Latency of a TLB lookup, paid by every access
+    const Cycles tlbLatency;
+
+    /// Latency of reading one table of the tree on a TLB miss
+    const Cycles perLevelLatency;
+
+    /// Latency of accessing a data block
+    const Cycles dataLatency;
 
     /// The block size for the cache
     const unsigned blockSize;
@@ -273,11 +731,49 @@ class DbrcCache : public ClockedObject
     /// Number of blocks in the cache (size of cache / block size)
     const unsigned capacity;
 
+    /// Number of banks, and of DBA entries in each of them
+    const unsigned numBanks;
+    const unsigned entriesPerBank;
+
+    /// Number of MSHRs, i.e. distinct blocks that can be outstanding
+    const unsigned numMSHRs;
+
+    /// Number of accesses that can wait on a single MSHR
+    const unsigned tgtsPerMSHR;
+
+    /// Number of writebacks that can wait for the memory side port
+    const unsigned numWriteBuffers;
+
     const unsigned target_BTH;
     const unsigned num_BTH;
     const unsigned TLB_size;
+    const unsigned TLB_assoc;
     const unsigned MNA;
-    uint32_t L0T_offset; 
+
+    /// Policy selecting the DBA entries to replace
+    const Enums::DbrcReplacementPolicy replacementPolicy;
+
+    /// DBA entries of a bank that can be locked at most
+    const unsigned maxLockedPerBank;
+
+    /// Blocks fetched ahead of the stream of a requestor, 0 disables
+    /// the prefetcher
+    const unsigned prefetchDegree;
+
+    /// True if the path of the next L0T region is built ahead of a stream
+    const bool prefetchPaths;
+
+    /// Timing requests each CPU side port can queue
+    const unsigned portQueueSize;
+
+    /// How the queued requests of the CPU side ports are granted
+    const Enums::DbrcArbitration arbitration;
+
+    /// Grants per turn, by requestor ID, under weighted QoS
+    const std::vector<unsigned> requestorWeights;
+
+    /// The system the cache is part of, for the memory mode
+    System *system;
 
     /// Instantiation of the CPU-side port
     std::vector<CPUSidePort> cpuPorts;
@@ -285,25 +781,75 @@ class DbrcCache : public ClockedObject
     /// Instantiation of the memory-side port
     MemSidePort memPort;
 
-    /// True if this cache is currently blocked waiting for a response.
+    /// Input queue of each CPU side port, by port ID
+    std::vector<InputQueue> inputQueues;
+
+    /// Port the arbiter looks at first
+    unsigned arbiterNext;
+
+    /// Grants the queued requests
+    EventFunctionWrapper arbitrateEvent;
+
+    /// True if this cache can not accept requests because the MSHRs, the
+    /// targets of an MSHR or the write buffer are exhausted, or there is not
+    /// enough of them for all the parts of a split access.
     bool blocked;
 
-    /// Packet that we are currently handling. Used for upgrading to larger
-    /// cache line sizes
-    PacketPtr originalPacket;
+    /// Outstanding misses, in allocation order
+    std::list<MSHR> mshrQueue;
+
+    /// Writebacks of dirty blocks waiting to be sent, oldest first. Each
+    /// packet owns a copy of the block.
+    std::deque<PacketPtr> writeBuffer;
+
+    /// True if a fill response was refused because the write buffer was
+    /// full. It is retried once writebacks have been sent.
+    bool respBlocked;
+
+    /// Responses, to either side, that are scheduled but not sent yet,
+    /// and uncacheable accesses waiting for the memory side
+    unsigned pendingResponses;
+
+    /// A request a cache above responded to. It is only deleted once the
+    /// next one comes, as the sender still uses it.
+    std::unique_ptr<Packet> pendingDelete;
+
+    /// Back-invalidations waiting for dirty data, by block address
+    std::unordered_map<Addr, BackInvalidation> backInvalidations;
+
+    /// Parts of a split access waiting for a free MSHR or write buffer.
+    /// No other request is handled until they are all issued.
+    std::deque<PacketPtr> splitParts;
+
+    /// Port the waiting parts came from
+    int splitPort;
+
+    /// Keeps the statistics of the core
+    CoreListener coreListener;
+
+    /// The tree, the TLB and the replacement of the DBA entries
+    DbrcCore core;
+
+    /// Structures of the core. The DUT holds the coherence state as well.
+    DbrcTLB &cache_TLB;
+    DbrcDBA &cache_DBA;
+
+    /// The lookup pipeline of each bank can not start another access
+    /// before this tick
+    std::vector<Tick> bankNextIssue;
+
+    /// Writebacks of the dirty blocks the core evicts, while it installs a
+    /// block or path
+    PacketList *evictions;
 
-    /// The port to send the response when we recieve it back
-    int waitingPortId;
+    /// Stream of each requestor
+    std::unordered_map<RequestorID, PrefetchStream> prefetchStreams;
 
-    /// For tracking the miss latency
-    Tick missTime;
+    /// Prefetched blocks no demand access has hit yet
+    std::unordered_set<Addr> prefetchedBlocks;
 
-    /// TLB buffer. Unordered map since fully-associative
-    std::unordered_map<uint32_t, uint32_t> cache_TLB;
-    std::vector<uint32_t> cache_TLB_order;
-    uint32_t VBIR; 
-    BTH_entry* cache_L0T;
-    DBA_entry* cache_DBA;
+    /// Writes the trace in the background, null if none is recorded
+    std::unique_ptr<DbrcTraceRecorder> recorder;
 
     /// Cache statistics
   protected:
@@ -312,6 +858,55 @@ class DbrcCache : public ClockedObject
         DbrcCacheStats(Stats::Group *parent);
         Stats::Scalar hits;
         Stats::Scalar misses;
+        Stats::Scalar mshrHits;
+        Stats::Scalar splitAccesses;
+        Stats::Scalar blockedNoMSHRs;
+        Stats::Vector bankAccesses;
+        Stats::Scalar bankConflicts;
+        Stats::Scalar blockedNoWBuffers;
+        Stats::Scalar writebacks;
+        Stats::Scalar writebackBytes;
+        Stats::Scalar writeBufferHits;
+        Stats::Average writeBufferOccupancy;
+        Stats::Formula writebackBandwidth;
+        Stats::Scalar tlbHits;
+        Stats::Scalar tlbMisses;
+        Stats::Scalar tlbTableHits;
+        Stats::Scalar tlbEvictions;
+        Stats::Formula tlbHitRatio;
+        Stats::Vector walkHits;
+        Stats::Vector walkMisses;
+        Stats::Distribution insertLevels;
+        Stats::Scalar tableVictims;
+        Stats::Scalar dataVictims;
+        Stats::Scalar droppedEntries;
+        Stats::Distribution victimScanLength;
+        Stats::Scalar victimScansExhausted;
+        Stats::Average lockedEntries;
+        Stats::Scalar lockRefusals;
+        Stats::Scalar upgradeMisses;
+        Stats::Scalar uncacheableAccesses;
+        Stats::Scalar snoops;
+        Stats::Scalar snoopHits;
+        Stats::Scalar snoopResponses;
+        Stats::Scalar snoopsDeferred;
+        Stats::Scalar snoopInvalidations;
+        Stats::Scalar backInvalidationsSent;
+        Stats::Scalar backInvalidationsDirty;
+        Stats::Vector portRequests;
+        Stats::Vector portRefusals;
+        Stats::Vector portQueueLatency;
+        Stats::Formula avgPortQueueLatency;
+        Stats::Scalar prefetchesIssued;
+        Stats::Scalar prefetchesUseful;
+        Stats::Scalar prefetchesLate;
+        Stats::Scalar prefetchesUnused;
+        Stats::Scalar pathPrefetches;
+        Stats::Formula prefetchAccuracy;
+        Stats::Formula prefetchCoverage;
+        Stats::Scalar tracedAccesses;
+        Stats::Scalar traceStalls;
+        Stats::Histogram hitLatency;
         Stats::Histogram missLatency;
         Stats::Formula hitRatio;
     } stats;
@@ -322,8 +917,6 @@ class DbrcCache : public ClockedObject
      */
     DbrcCache(DbrcCacheParams *params);
 
-    ~DbrcCache();
-
     /**
      * Get a port with a given name and index. This is used at
      * binding time and returns a reference to a protocol-agnostic
@@ -337,6 +930,36 @@ class DbrcCache : public ClockedObject
     Port &getPort(const std::string &if_name,
                   PortID idx=InvalidPortID) override;
 
+    /**
+     * Lock the blocks of an address range in the cache, with the tables on
+     * their path, so that they are never replaced. The blocks already in
+     * the cache are locked right away, the others once they are installed.
+     */
+    void lockRange(Addr start, Addr size);
+
+    /// Unlock a range given to lockRange() or the locked_ranges parameter
+    void unlockRange(Addr start, Addr size);
+
+    /**
+     * Wait for the outstanding fills, the responses and the writebacks to
+     * be sent before a checkpoint or a CPU switch.
+     */
+    DrainState drain() override;
+
+    /**
+     * Save the L0Ts, the DBA, the B-TLB and VBIRs. The structures are written
+     * in bulk to a compressed binary file next to the checkpoint, in host
+     * byte order.
+     */
+    void serialize(CheckpointOut &cp) const override;
+
+    /**
+     * Restore the state saved by serialize(). The block size, the size, the
+     * number of banks and the number of BTH levels must match, the TLB may
+     * have another size.
+     */
+    void unserialize(CheckpointIn &cp) override;
+
 };
 
 
@@ -0,0 +1,493 @@
+#include "dbrc_core.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+DbrcCore::DbrcCore(const Config &config, DbrcCoreListener *listener) :
+    blockSize(config.blockSize),
+    capacity(config.capacity),
+    numBanks(config.numBanks),
+    entriesPerBank(numBanks ? capacity / numBanks : 0),
+    num_BTH(config.numBTH),
+    target_BTH(config.targetBTH),
+    maxLockedPerBank(config.maxLockedPerBank),
+    geometry(blockSize, num_BTH), walkKernel(dbrcSelectWalk(geometry)),
+    cache_TLB(config.tlbSize, config.tlbAssoc),
+    cache_DBA(capacity, blockSize),
+    lockedRanges(config.lockedRanges),
+    listener(listener)
+{
+    banks.resize(numBanks);
+    for (unsigned i = 0; i < numBanks; i++) {
+        banks[i].base = i * entriesPerBank;
+        banks[i].VBIR = banks[i].base;
+        banks[i].locked = 0;
+    }
+
+    switch (config.policy) {
+      case Clock:
+        replacement.reset(new DbrcClockReplacement(cache_DBA, config.mna));
+        break;
+      case SRRIP:
+      case BRRIP:
+        replacement.reset(new DbrcRRIPReplacement(
+            cache_DBA, config.policy == BRRIP));
+        break;
+      case TreePLRU:
+        replacement.reset(new DbrcTreePLRUReplacement(cache_DBA,
+                                                      entriesPerBank));
+        break;
+      case LevelAware:
+        replacement.reset(new DbrcLevelAwareReplacement(cache_DBA,
+                                                        config.mna, num_BTH));
+        break;
+    }
+    assert(replacement);
+    insertPath.reserve(num_BTH);
+}
+
+DbrcCore::Lookup
+DbrcCore::lookup(uint64_t block_addr)
+{
+    Lookup result = {false, 0, false, 0, 0};
+
+    // TLB Search
+    if (cache_TLB.lookup(block_addr / blockSize, result.index)) {
+        result.found = result.tlbHit = true;
+        return result;
+    }
+
+    // Start at the deepest table of the path in the TLB, if any, or do a
+    // full Cache Search
+    result.start = findCachedTable(block_addr, result.index);
+    if (result.start > 0) {
+        result.found = dbrcWalkFrom(geometry, cache_DBA, bankAddr(block_addr),
+                                    block_addr / blockSize, result.start,
+                                    result.index, &result.levels);
+    } else {
+        result.found = CacheSearch(block_addr, result.index, &result.levels);
+    }
+
+    // Write cache find to TLB
+    if (result.found)
+        insertInTLB(block_addr, result.index);
+
+    return result;
+}
+
+bool
+DbrcCore::isCached(uint64_t block_addr) const
+{
+    return cache_TLB.contains(block_addr / blockSize) ||
+           pathDepth(block_addr) == num_BTH;
+}
+
+bool
+DbrcCore::findBlock(uint64_t block_addr, uint32_t &index) const
+{
+    return pathDepth(block_addr, &index) == num_BTH;
+}
+
+unsigned
+DbrcCore::pathDepth(uint64_t block_addr, uint32_t *last) const
+{
+    const Bank &bank = banks[bankOf(block_addr)];
+    uint64_t bank_addr = bankAddr(block_addr);
+    const BTH_entry *entry = bank.L0T.find(geometry.region(bank_addr));
+    unsigned depth = 0;
+    while (entry && entry->V) {
+        uint32_t index = entry->I;
+        if (last)
+            *last = index;
+        if (++depth == num_BTH) {
+            bool hit = cache_DBA.dut(index).LF == num_BTH &&
+                       cache_DBA.tt(index).TAG == block_addr / blockSize;
+            return hit ? depth : depth - 1;
+        }
+        entry = &cache_DBA.bth(index)[geometry.slot(bank_addr, depth + 1)];
+    }
+    return depth;
+}
+
+// Search DBRC for data block
+bool
+DbrcCore::CacheSearch(uint64_t block_addr, uint32_t &index, unsigned *levels)
+{
+    const Bank &bank = banks[bankOf(block_addr)];
+    return walkKernel(geometry, bank.L0T, cache_DBA, bankAddr(block_addr),
+                      block_addr >> geometry.blockBits(), index, levels);
+}
+
+uint64_t
+DbrcCore::tableKey(uint64_t block_addr, unsigned level) const
+{
+    // Tables are told apart from data blocks, and from the tables of the
+    // other levels, by the top bits
+    uint64_t table = bankAddr(block_addr) >> geometry.slotShift(level);
+    return (uint64_t(level) << 59) | (table * numBanks + bankOf(block_addr));
+}
+
+unsigned
+DbrcCore::findCachedTable(uint64_t block_addr, uint32_t &index)
+{
+    for (unsigned level = num_BTH - 1; level >= target_BTH; level--) {
+        uint64_t key = tableKey(block_addr, level);
+        if (!cache_TLB.lookup(key, index))
+            continue;
+        // Tables are dropped from the TLB when they or a table above them
+        // are replaced
+        const DUT_entry &dut = cache_DBA.dut(index);
+        assert(dut.V && dut.PV && dut.LF == level &&
+               cache_DBA.tt(index).TAG == key);
+        (void)dut;
+        return level;
+    }
+    return 0;
+}
+
+void
+DbrcCore::insertInTLB(uint64_t block_addr, uint32_t index)
+{
+    if (cache_TLB.insert(block_addr / blockSize, index) && listener)
+        listener->tlbEvicted();
+    // Follow the path up to the tables that are cached as well
+    for (unsigned level = num_BTH - 1; level >= target_BTH; level--) {
+        index = cache_DBA.tt(index).PT;
+        if (cache_TLB.insert(cache_DBA.tt(index).TAG, index) && listener)
+            listener->tlbEvicted();
+    }
+}
+
+/**
+ * @brief Insert data in to cache after memory response. Handle write-back and replacement policy.
+ *
+ * @details
+ *      1.  b = Select a DBA victim block
+ *      2.  Make the BTH entry in level N point to b
+ *      3.  if (b's DUT entry bits V==true and PV==true)
+ *      3.1     Invalidate the entry of the BTH table that points to b
+ *      3.2     Invalidate tan eventual entry in the B-TLB that points to b
+ *      3.3     if (b'2 DUT entry LF field indicates the b holds a BTH table)
+ *      3.3.1       Invalidate DUT entries associated with b's children
+ *      3.4     else if (b's DUT entry dirty bit D==true)
+ *      3.4.1       Save b's contents into physical memory
+ *      4.  Install block level N+1
+ *      5.  if (++N < data block level) goto 1
+ */
+unsigned
+DbrcCore::insert(uint64_t address, const uint8_t *data, bool dirty,
+                 uint32_t &last_BTH, uint32_t max_dropped)
+{
+    // The address should be aligned.
+    assert((address & (blockSize - 1)) == 0);
+    // The address should not be in the TLB
+    assert(!cache_TLB.contains(address/blockSize));
+
+    unsigned installed = installPath(address, num_BTH, last_BTH,
+                                     max_dropped);
+
+    cache_DBA.tt(last_BTH).TAG = address/blockSize;
+    cache_DBA.dut(last_BTH).D = dirty;
+
+    // Write cache find to TLB
+    insertInTLB(address, last_BTH);
+
+    // Write the data into the cache
+    std::memcpy(cache_DBA.data(last_BTH), data, blockSize);
+
+    if (isLocked(address))
+        lockPath(last_BTH);
+
+    return installed;
+}
+
+unsigned
+DbrcCore::installPath(uint64_t address, unsigned last_level,
+                      uint32_t &last_BTH, uint32_t max_dropped)
+{
+    unsigned current_level;
+
+    // Address should not be valid in the Cache. Set last valid BTH index.
+    bool found = CacheSearch(address, last_BTH);
+    assert(!found);
+    (void)found;
+
+    Bank &bank = banks[bankOf(address)];
+    uint64_t bank_addr = bankAddr(address);
+
+    // Tables on the path to the new block must not be picked as victims
+    insertPath.clear();
+
+    // Miss in L0T
+    if (last_BTH == DbrcNoEntry)
+    {
+        current_level = 0;
+    }
+    else
+    {
+        current_level = cache_DBA.dut(last_BTH).LF;
+        for (uint32_t idx = last_BTH; ; idx = cache_DBA.tt(idx).PT)
+        {
+            insertPath.push_back(idx);
+            if (cache_DBA.dut(idx).LF == 1)
+                break;
+        }
+    }
+
+    current_level++;
+    unsigned installed = 0;
+
+    while(current_level <= last_level)
+    {
+        // Select DBA victim block and evict its contents. Keep one block
+        // for each entry left to replace, so that a data block always can
+        // be.
+        uint32_t victim;
+        if (max_dropped == DbrcReplacement::NoLimit) {
+            victim = findVictim(bank, max_dropped);
+        } else {
+            unsigned later = last_level - current_level;
+            victim = findVictim(bank, max_dropped > later ?
+                                      max_dropped - later : 1);
+            max_dropped -= std::min(max_dropped,
+                                    replacement->dropCost(victim));
+        }
+        evict(victim);
+
+        uint32_t slot = 0;
+        if (current_level == 1)
+        {
+            // Make the BTH entry in L0T point to b and set valid
+            bank.L0T[geometry.region(bank_addr)].I = victim;
+            bank.L0T[geometry.region(bank_addr)].V = true;
+        }
+        else
+        {
+            // Make the BTH entry in level N point to b and set valid
+            slot = geometry.slot(bank_addr, current_level);
+            cache_DBA.bth(last_BTH)[slot].I = victim;
+            cache_DBA.bth(last_BTH)[slot].V = true;
+        }
+
+        // Install block level N+1
+        // Clear data memory
+        cache_DBA.clearBlock(victim);
+
+        cache_DBA.dut(victim).V = true;
+        cache_DBA.dut(victim).D = false;
+        cache_DBA.dut(victim).W = false;
+        cache_DBA.dut(victim).C = false;
+        cache_DBA.dut(victim).PV = true;
+        cache_DBA.dut(victim).LF = current_level;
+        cache_DBA.dut(victim).R = 1;
+        replacement->reset(victim, current_level);
+        if (current_level == 1)
+            cache_DBA.tt(victim).PT = geometry.region(bank_addr);
+        else
+            cache_DBA.tt(victim).PT = last_BTH;
+        cache_DBA.tt(victim).PS = slot;
+        // The key of a table in the TLB, the data block gets its tag
+        cache_DBA.tt(victim).TAG = tableKey(address, current_level);
+
+        insertPath.push_back(victim);
+        last_BTH = victim;
+        current_level++;
+        installed++;
+        bank.VBIR = victim + 1;
+        if(bank.VBIR >= bank.base + entriesPerBank)
+        {
+            bank.VBIR = bank.base;
+        }
+
+        // if (++N < data block level) goto 1
+    }
+
+    return installed;
+}
+
+uint32_t
+DbrcCore::findVictim(Bank &bank, uint32_t max_dropped)
+{
+    replacement->setDropLimit(max_dropped);
+    DbrcReplacement::Victim victim =
+        replacement->getVictim(bank.base, entriesPerBank, bank.VBIR,
+                               insertPath);
+    // The configuration leaves num_BTH entries of each bank unlocked
+    assert(victim.index != DbrcReplacement::NoVictim);
+
+    if (listener)
+        listener->victimSelected(victim.index, victim);
+
+    return victim.index;
+}
+
+void
+DbrcCore::evict(uint32_t b)
+{
+    DUT_entry &dut = cache_DBA.dut(b);
+    TT_entry &tt = cache_DBA.tt(b);
+
+    // Nothing to do if b was not valid
+    if (!dut.V || dut.LF == 0)
+        return;
+
+    if (dut.PV)
+    {
+        // Invalidate the entry of the BTH table that points to b. The parent
+        // slot is recorded in the TT, so there is no need to search for it.
+        BTH_entry &parent = dut.LF == 1 ?
+                            banks[b / entriesPerBank].L0T[tt.PT] :
+                            cache_DBA.bth(tt.PT)[tt.PS];
+        assert(parent.V && parent.I == b);
+        parent.V = false;
+    }
+
+    // Invalidate an entry in the B-TLB that points to b. Tables are
+    // keyed by the key in their TAG.
+    if (dut.LF == num_BTH || dut.LF >= target_BTH)
+    {
+        cache_TLB.erase(tt.TAG);
+    }
+
+    // if (b's DUT entry LF field indicates the b holds a BTH table)
+    if (dut.LF < num_BTH)
+    {
+        // A walk can not reach b's children anymore. Drop the whole subtree,
+        // its blocks written back and out of the TLB, rather than leave
+        // blocks cached that only the TLB can find.
+        BTH_entry *children = cache_DBA.bth(b);
+        for (size_t i = 0; i < blockSize/2; i++)
+        {
+            if (children[i].V)
+            {
+                uint32_t child = children[i].I;
+                if (listener)
+                    listener->entryDropped(child);
+                invalidate(child);
+            }
+        }
+    }
+    // else if (b's DUT entry dirty bit D==true)
+    else if (listener)
+    {
+        // Save b's contents into physical memory, and whatever else the
+        // owner of the core keeps about the block
+        listener->blockEvicted(b);
+    }
+
+    tt.TAG = 0;
+}
+
+void
+DbrcCore::invalidate(uint32_t b)
+{
+    // Tables are dropped with their subtree, see evict()
+    DUT_entry &dut = cache_DBA.dut(b);
+    if (dut.L) {
+        dut.L = false;
+        banks[b / entriesPerBank].locked--;
+    }
+    evict(b);
+    dut.V = false;
+}
+
+bool
+DbrcCore::isLocked(uint64_t block_addr) const
+{
+    for (const auto &range : lockedRanges) {
+        if (block_addr >= range.first && block_addr < range.second)
+            return true;
+    }
+    return false;
+}
+
+bool
+DbrcCore::lockPath(uint32_t b)
+{
+    Bank &bank = banks[b / entriesPerBank];
+
+    // Count what is not locked yet, up to the level 1 table. Replacing a
+    // table drops its subtree, so the path is complete unless it comes from
+    // a checkpoint that still had blocks without a parent.
+    unsigned to_lock = 0;
+    for (uint32_t idx = b; ; idx = cache_DBA.tt(idx).PT) {
+        const DUT_entry &dut = cache_DBA.dut(idx);
+        if (!dut.PV)
+            return false;
+        to_lock += !dut.L;
+        if (dut.LF == 1)
+            break;
+    }
+
+    if (bank.locked + to_lock > maxLockedPerBank) {
+        if (listener)
+            listener->lockRefused(b);
+        return false;
+    }
+
+    for (uint32_t idx = b; ; idx = cache_DBA.tt(idx).PT) {
+        DUT_entry &dut = cache_DBA.dut(idx);
+        dut.L = true;
+        if (dut.LF == 1)
+            break;
+    }
+    bank.locked += to_lock;
+
+    return true;
+}
+
+void
+DbrcCore::applyLocks()
+{
+    for (auto &bank : banks)
+        bank.locked = 0;
+    for (uint32_t i = 0; i < capacity; i++)
+        cache_DBA.dut(i).L = false;
+
+    for (uint32_t i = 0; i < capacity; i++) {
+        const DUT_entry &dut = cache_DBA.dut(i);
+        if (dut.V && dut.LF == num_BTH &&
+            isLocked(cache_DBA.tt(i).TAG * blockSize))
+            lockPath(i);
+    }
+}
+
+void
+DbrcCore::lockRange(uint64_t start, uint64_t end)
+{
+    lockedRanges.emplace_back(start, end);
+    applyLocks();
+}
+
+bool
+DbrcCore::unlockRange(uint64_t start, uint64_t end)
+{
+    auto range = std::find(lockedRanges.begin(), lockedRanges.end(),
+                           Range(start, end));
+    if (range == lockedRanges.end())
+        return false;
+
+    lockedRanges.erase(range);
+    applyLocks();
+    return true;
+}
+
+void
+DbrcCore::recountLocked()
+{
+    for (auto &bank : banks) {
+        bank.locked = 0;
+        for (uint32_t i = bank.base; i < bank.base + entriesPerBank; i++)
+            bank.locked += cache_DBA.dut(i).L;
+    }
+}
+
+unsigned
+DbrcCore::lockedEntries() const
+{
+    unsigned locked = 0;
+    for (const auto &bank : banks)
+        locked += bank.locked;
+    return locked;
+}
@@ -0,0 +1,340 @@
+#ifndef __LEARNING_GEM5_DBRC_CORE_HH__
+#define __LEARNING_GEM5_DBRC_CORE_HH__
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "dbrc_dba.hh"
+#include "dbrc_entries.hh"
+#include "dbrc_l0t.hh"
+#include "dbrc_replacement.hh"
+#include "dbrc_tlb.hh"
+#include "dbrc_walk.hh"
+
+/**
+ * Told about what the DBRC core does to its entries. The gem5 cache keeps
+ * its statistics and writes dirty blocks back from here. Every method does
+ * nothing by default.
+ */
+class DbrcCoreListener
+{
+  public:
+    virtual ~DbrcCoreListener() { }
+
+    /// A victim was selected, its entry is not evicted yet
+    virtual void
+    victimSelected(uint32_t index, const DbrcReplacement::Victim &victim)
+    { }
+
+    /// A data block is leaving the cache, its entry still holds it
+    virtual void blockEvicted(uint32_t index) { }
+
+    /// A valid entry is dropped along with a table above it that was
+    /// replaced, it still holds its contents
+    virtual void entryDropped(uint32_t index) { }
+
+    /// Inserting in the TLB evicted another entry
+    virtual void tlbEvicted() { }
+
+    /// The path to a data block in a locked range was not locked, its bank
+    /// has too many locked entries already
+    virtual void lockRefused(uint32_t index) { }
+};
+
+/**
+ * The DBRC algorithm: the tree of BTH tables over the DBA, the B-TLB, the
+ * replacement of DBA entries and the locked ranges. Blocks are interleaved
+ * across banks by block number. Each bank has its own L0T and slice of the
+ * DBA, with its own VBIR, so the trees of different banks are independent.
+ *
+ * This class does not depend on gem5. The DbrcCache SimObject wraps it with
+ * the timing, the ports and the coherence state, and the standalone trace
+ * simulator drives it directly, so both see the same hits and misses.
+ */
+class DbrcCore
+{
+  public:
+    /// Replacement policies, in the order of DbrcReplacementPolicy
+    enum Policy { Clock, SRRIP, BRRIP, TreePLRU, LevelAware };
+
+    /// An address range [first, second)
+    typedef std::pair<uint64_t, uint64_t> Range;
+
+    struct Config
+    {
+        unsigned blockSize;
+
+        /// Number of DBA entries, a multiple of numBanks
+        uint32_t capacity;
+        unsigned numBanks;
+
+        unsigned numBTH;
+
+        /// Shallowest level whose tables are cached in the TLB, numBTH for
+        /// data blocks only
+        unsigned targetBTH;
+
+        unsigned tlbSize;
+        unsigned tlbAssoc;
+
+        /// Maximum number of attempts of the clock policies
+        unsigned mna;
+        Policy policy;
+
+        /// DBA entries of a bank that can be locked at most
+        unsigned maxLockedPerBank;
+
+        /// Blocks in these ranges are locked when they are installed
+        std::vector<Range> lockedRanges;
+    };
+
+    /// A bank of the DBRC
+    struct Bank
+    {
+        DbrcL0T L0T;
+
+        /// First DBA entry of the slice of the bank
+        uint32_t base;
+
+        /// Replacement clock hand, within the slice of the bank
+        uint32_t VBIR;
+
+        /// DBA entries of the slice that are locked
+        unsigned locked;
+    };
+
+    /// The result of looking a block up
+    struct Lookup
+    {
+        bool found;
+
+        /// DBA entry of the block, if found
+        uint32_t index;
+
+        bool tlbHit;
+
+        /// Level of the table in the TLB the walk started from, 0 if it
+        /// started from the L0T
+        unsigned start;
+
+        /// Tables and blocks read by the walk, 0 on a TLB hit
+        unsigned levels;
+    };
+
+    /**
+     * The caller has to check the configuration, see coreConfig() in
+     * dbrc_cache.cc.
+     *
+     * @param listener told about evictions and the like, may be null
+     */
+    DbrcCore(const Config &config, DbrcCoreListener *listener = nullptr);
+
+    /**
+     * Look a block up in the TLB, then walk the tree from the deepest table
+     * of its path in the TLB or from the L0T. A block the walk finds is
+     * mapped in the TLB, along with the cached tables of its path.
+     */
+    Lookup lookup(uint64_t block_addr);
+
+    /// Tell the replacement policy that a block was accessed
+    void touch(uint32_t index) { replacement->touch(index); }
+
+    /// True if a block is in the cache. Leaves the replacement state alone.
+    bool isCached(uint64_t block_addr) const;
+
+    /**
+     * Number of levels of the path to a block that are in the cache,
+     * num_BTH if the block is. Leaves the replacement state alone.
+     *
+     * @param index if not null, set to the last entry of the path found
+     */
+    unsigned pathDepth(uint64_t block_addr, uint32_t *index = nullptr) const;
+
+    /**
+     * Find the DBA entry of a block. Leaves the TLB and the replacement
+     * state alone.
+     *
+     * @return true if the block is in the cache
+     */
+    bool findBlock(uint64_t block_addr, uint32_t &index) const;
+
+    /**
+     * Insert a block that is not in the cache. The missing tables of its
+     * path are installed first, replacing entries as needed. The block is
+     * mapped in the TLB and locked if it is in a locked range.
+     *
+     * @param data of the whole block
+     * @param dirty true if data is newer than the copy in memory
+     * @param index set to the DBA entry of the block
+     * @param max_dropped blocks the replaced entries may drop together
+     *        that are dirty or cached above, at least num_BTH. Tables whose
+     *        subtree does not fit are not replaced.
+     * @return number of levels installed, the block included
+     */
+    unsigned insert(uint64_t block_addr, const uint8_t *data, bool dirty,
+                    uint32_t &index,
+                    uint32_t max_dropped = DbrcReplacement::NoLimit);
+
+    /**
+     * Install the missing tables, and blocks, on the path to an address
+     * down to a level. Entries are replaced as for insert().
+     *
+     * @param last_level level of the last table or block to install
+     * @param last_BTH set to the last valid table or block on the path
+     * @param max_dropped as for insert()
+     * @return number of levels installed
+     */
+    unsigned installPath(uint64_t address, unsigned last_level,
+                         uint32_t &last_BTH,
+                         uint32_t max_dropped = DbrcReplacement::NoLimit);
+
+    /**
+     * Drop an entry, unlocking it if it was locked. The listener is told
+     * about it like about a replacement.
+     */
+    void invalidate(uint32_t b);
+
+    /// Lock the blocks of a range, those in the cache and those to come
+    void lockRange(uint64_t start, uint64_t end);
+
+    /**
+     * Unlock a range that was locked, and lock the blocks of the other
+     * ranges again.
+     *
+     * @return false if the range was not locked
+     */
+    bool unlockRange(uint64_t start, uint64_t end);
+
+    const std::vector<Range> &getLockedRanges() const { return lockedRanges; }
+
+    /**
+     * Replace the locked ranges, e.g. when restoring a checkpoint. The lock
+     * bits of the DUT are left alone.
+     */
+    void setLockedRanges(const std::vector<Range> &ranges)
+    { lockedRanges = ranges; }
+
+    /// Count the locked entries of each bank from the lock bits of the DUT
+    void recountLocked();
+
+    /// Locked DBA entries, in all banks
+    unsigned lockedEntries() const;
+
+    /// Bank of a block
+    unsigned bankOf(uint64_t block_addr) const
+    { return (block_addr / blockSize) % numBanks; }
+
+    /// Address of a block within its bank, used to index the L0T and BTHs
+    uint64_t bankAddr(uint64_t block_addr) const
+    { return (block_addr / blockSize) / numBanks * blockSize; }
+
+    const DbrcGeometry &getGeometry() const { return geometry; }
+    DbrcDBA &getDBA() { return cache_DBA; }
+    DbrcTLB &getTLB() { return cache_TLB; }
+    Bank &getBank(unsigned i) { return banks[i]; }
+    const Bank &getBank(unsigned i) const { return banks[i]; }
+    DbrcReplacement &getReplacement() { return *replacement; }
+    const DbrcReplacement &getReplacement() const { return *replacement; }
+
+  private:
+    /**
+     * Walk the L0T and the BTH tables down to the data block of an address.
+     *
+     * @param block aligned address to look for
+     * @param index of last valid BTH or data block, DbrcNoEntry if none
+     * @param levels if not null, set to the number of tables read
+     *
+     * @return true if a hit, false otherwise
+     */
+    bool CacheSearch(uint64_t block_addr, uint32_t &index,
+                     unsigned *levels = nullptr);
+
+    /**
+     * Key of a table of the path to a block in the TLB. The TLB holds the
+     * tables of levels target_BTH to num_BTH - 1 as well as data blocks.
+     */
+    uint64_t tableKey(uint64_t block_addr, unsigned level) const;
+
+    /**
+     * Find the deepest table of the path to a block in the TLB.
+     *
+     * @param index set to the DBA entry of the table
+     * @return level of the table, 0 if none is in the TLB
+     */
+    unsigned findCachedTable(uint64_t block_addr, uint32_t &index);
+
+    /**
+     * Map a data block, and the tables of its path that are cached, in the
+     * TLB.
+     *
+     * @param index DBA entry of the data block
+     */
+    void insertInTLB(uint64_t block_addr, uint32_t index);
+
+    /**
+     * Select the DBA entry of a bank to replace with the replacement
+     * policy. Locked entries and the tables on the path being installed
+     * are never taken.
+     *
+     * @param max_dropped blocks the victim may drop, see
+     *        DbrcReplacement::dropCost()
+     * @return index of the victim
+     */
+    uint32_t findVictim(Bank &bank, uint32_t max_dropped);
+
+    /**
+     * Evict the contents of a DBA entry. Unlink it from its parent table,
+     * drop it from the TLB and, if it is a table, drop its whole subtree.
+     * The listener is told about data blocks before they go.
+     */
+    void evict(uint32_t b);
+
+    /// True if a block is in a locked range
+    bool isLocked(uint64_t block_addr) const;
+
+    /**
+     * Lock a data block and the tables on its path, unless that would
+     * lock more than the share of its bank that can be locked.
+     *
+     * @param index of the DBA entry of the data block
+     * @return true if the whole path is locked
+     */
+    bool lockPath(uint32_t b);
+
+    /**
+     * Set the lock bits from scratch: lock the blocks in the cache that are
+     * in a locked range, and the tables on their path.
+     */
+    void applyLocks();
+
+    const unsigned blockSize;
+    const uint32_t capacity;
+    const unsigned numBanks;
+    const uint32_t entriesPerBank;
+    const unsigned num_BTH;
+    const unsigned target_BTH;
+    const unsigned maxLockedPerBank;
+
+    /// Index arithmetic of the tree
+    const DbrcGeometry geometry;
+
+    /// Walk specialized for the geometry, used by CacheSearch()
+    const DbrcWalkFn walkKernel;
+
+    /// TLB buffer. Set-associative with LRU replacement
+    DbrcTLB cache_TLB;
+    DbrcDBA cache_DBA;
+    std::vector<Bank> banks;
+    std::unique_ptr<DbrcReplacement> replacement;
+
+    /// DBA entries of the path being installed by installPath()
+    std::vector<uint32_t> insertPath;
+
+    std::vector<Range> lockedRanges;
+
+    DbrcCoreListener *listener;
+};
+
+#endif // __LEARNING_GEM5_DBRC_CORE_HH__
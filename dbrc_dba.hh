@@ -0,0 +1,142 @@
+#ifndef __LEARNING_GEM5_DBRC_DBA_HH__
+#define __LEARNING_GEM5_DBRC_DBA_HH__
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "dbrc_entries.hh"
+
+/**
+ * Storage of the DBA (data block array).
+ *
+ * Everything lives in a single cache line aligned arena, laid out as a
+ * struct of arrays: the block payloads, the BTH table of each entry, then
+ * the DUT and TT metadata. Walks and victim scans only touch the small
+ * metadata arrays, and construction is one allocation instead of two per
+ * entry.
+ *
+ * This class does not depend on gem5 so the standalone trace simulator can
+ * use it as well.
+ */
+class DbrcDBA
+{
+  public:
+    /// Alignment of the arena and of each array in it
+    static const size_t Align = 64;
+
+    /**
+     * @param capacity number of DBA entries
+     * @param block_size bytes per block. Each BTH table has block_size/2
+     *        entries.
+     */
+    DbrcDBA(unsigned capacity, unsigned block_size) :
+        numEntries(capacity), blockSize(block_size),
+        bthEntries(block_size / 2)
+    {
+        size_t data_bytes = alignUp((size_t)capacity * blockSize);
+        size_t bth_bytes =
+            alignUp((size_t)capacity * bthEntries * sizeof(BTH_entry));
+        size_t dut_bytes = alignUp((size_t)capacity * sizeof(DUT_entry));
+        size_t tt_bytes = alignUp((size_t)capacity * sizeof(TT_entry));
+        arenaBytes = data_bytes + bth_bytes + dut_bytes + tt_bytes;
+
+        void *mem = nullptr;
+        if (posix_memalign(&mem, Align, arenaBytes ? arenaBytes : Align))
+            throw std::bad_alloc();
+        arena = static_cast<uint8_t *>(mem);
+        std::memset(arena, 0, arenaBytes);
+
+        dataArray = arena;
+        bthArray = reinterpret_cast<BTH_entry *>(arena + data_bytes);
+        dutArray = reinterpret_cast<DUT_entry *>(
+            arena + data_bytes + bth_bytes);
+        ttArray = reinterpret_cast<TT_entry *>(
+            arena + data_bytes + bth_bytes + dut_bytes);
+    }
+
+    ~DbrcDBA() { free(arena); }
+
+    DbrcDBA(const DbrcDBA &) = delete;
+    DbrcDBA &operator=(const DbrcDBA &) = delete;
+
+    /// Number of entries
+    unsigned size() const { return numEntries; }
+
+    /// Entries of each BTH table
+    unsigned tableEntries() const { return bthEntries; }
+
+    DUT_entry &dut(uint32_t i) { assert(i < numEntries); return dutArray[i]; }
+    const DUT_entry &
+    dut(uint32_t i) const
+    {
+        assert(i < numEntries);
+        return dutArray[i];
+    }
+
+    TT_entry &tt(uint32_t i) { assert(i < numEntries); return ttArray[i]; }
+    const TT_entry &
+    tt(uint32_t i) const
+    {
+        assert(i < numEntries);
+        return ttArray[i];
+    }
+
+    /// BTH table of an entry that holds one (block_size/2 entries)
+    BTH_entry *
+    bth(uint32_t i)
+    {
+        assert(i < numEntries);
+        return bthArray + (size_t)i * bthEntries;
+    }
+    const BTH_entry *
+    bth(uint32_t i) const
+    {
+        assert(i < numEntries);
+        return bthArray + (size_t)i * bthEntries;
+    }
+
+    /// Payload of an entry that holds a data block (block_size bytes)
+    uint8_t *
+    data(uint32_t i)
+    {
+        assert(i < numEntries);
+        return dataArray + (size_t)i * blockSize;
+    }
+
+    /// The whole arena, to save and restore the state in bulk
+    uint8_t *raw() { return arena; }
+    const uint8_t *raw() const { return arena; }
+
+    /// Size of the arena in bytes
+    size_t rawBytes() const { return arenaBytes; }
+
+    /// Clear the payload and BTH table of an entry before it is reused
+    void
+    clearBlock(uint32_t i)
+    {
+        std::memset(data(i), 0, blockSize);
+        std::memset(bth(i), 0, bthEntries * sizeof(BTH_entry));
+    }
+
+  private:
+    static size_t alignUp(size_t x) { return (x + Align - 1) & ~(Align - 1); }
+
+    const unsigned numEntries;
+    const unsigned blockSize;
+    const unsigned bthEntries;
+
+    /// The single allocation backing all arrays
+    uint8_t *arena;
+    size_t arenaBytes;
+
+    uint8_t *dataArray;
+    BTH_entry *bthArray;
+    DUT_entry *dutArray;
+    TT_entry *ttArray;
+};
+
+#endif // __LEARNING_GEM5_DBRC_DBA_HH__
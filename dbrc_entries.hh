@@ -0,0 +1,34 @@
+#ifndef __LEARNING_GEM5_DBRC_ENTRIES_HH__
+#define __LEARNING_GEM5_DBRC_ENTRIES_HH__
+
+#include <cstdint>
+
+/// Entry of a BTH table (or of the L0T). Points to a DBA entry.
+typedef struct
+{
+  bool V; //valid
+  uint32_t I; //index
+} BTH_entry;
+
+/// DBA usage table entry, the state of a DBA entry
+typedef struct
+{
+  bool V; //valid
+  bool D; //dirty
+  bool W; //writable, no copy outside this cache and the caches above
+  bool C; //cached_above, a cache above may hold a copy
+  bool L; //lock
+  uint8_t LF; //level
+  bool PV; //parent_valid
+  uint8_t R; //reutilization
+} DUT_entry;
+
+/// Tag table entry
+typedef struct
+{
+  uint64_t TAG; //block number of a data block
+  uint64_t PT; //parent_table, the L0T index for level 1 blocks
+  uint32_t PS; //parent_slot, the entry of the parent table pointing here
+} TT_entry;
+
+#endif // __LEARNING_GEM5_DBRC_ENTRIES_HH__
@@ -0,0 +1,114 @@
+#ifndef __LEARNING_GEM5_DBRC_L0T_HH__
+#define __LEARNING_GEM5_DBRC_L0T_HH__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include "dbrc_entries.hh"
+
+/**
+ * Level 0 table of the DBRC, indexed by region number (address divided by
+ * L0T_offset).
+ *
+ * Backing storage is allocated on demand in pages of PageEntries entries,
+ * so only regions that have been touched use host memory and the whole
+ * 64-bit physical address space can be indexed. Entries of pages that were
+ * never allocated read as invalid.
+ *
+ * This class does not depend on gem5 so the standalone trace simulator can
+ * use it as well.
+ */
+class DbrcL0T
+{
+  public:
+    static const unsigned PageBits = 12;
+    static const size_t PageEntries = size_t(1) << PageBits;
+
+    DbrcL0T() : lastPageNum(0), lastPage(nullptr) { }
+
+    /**
+     * Find the entry of a region without allocating.
+     *
+     * @return the entry, or nullptr if its page was never allocated
+     */
+    const BTH_entry *
+    find(uint64_t region) const
+    {
+        BTH_entry *page = findPage(region >> PageBits);
+        return page ? &page[region & (PageEntries - 1)] : nullptr;
+    }
+
+    /// Entry of a region, allocating its page if needed
+    BTH_entry &
+    operator[](uint64_t region)
+    {
+        uint64_t page_num = region >> PageBits;
+        BTH_entry *page = findPage(page_num);
+        if (!page) {
+            auto &slot = pageMap[page_num];
+            // Value initialized, i.e. all entries invalid
+            slot.reset(new BTH_entry[PageEntries]());
+            page = slot.get();
+            lastPageNum = page_num;
+            lastPage = page;
+        }
+        return page[region & (PageEntries - 1)];
+    }
+
+    /// Number of allocated pages
+    size_t pages() const { return pageMap.size(); }
+
+    /**
+     * Call f(page_num, entries) for every allocated page, in no particular
+     * order. A page holds the PageEntries regions starting at
+     * page_num << PageBits.
+     */
+    template <typename F>
+    void
+    forEachPage(F f) const
+    {
+        for (const auto &page : pageMap)
+            f(page.first, (const BTH_entry *)page.second.get());
+    }
+
+    /// Entries of a page, allocating it if needed
+    BTH_entry *
+    page(uint64_t page_num)
+    {
+        return &(*this)[page_num << PageBits];
+    }
+
+    /// Release all pages
+    void
+    clear()
+    {
+        pageMap.clear();
+        lastPage = nullptr;
+    }
+
+  private:
+    BTH_entry *
+    findPage(uint64_t page_num) const
+    {
+        // Walks are usually to the same region as the previous one
+        if (lastPage && lastPageNum == page_num)
+            return lastPage;
+        auto it = pageMap.find(page_num);
+        if (it == pageMap.end())
+            return nullptr;
+        lastPageNum = page_num;
+        lastPage = it->second.get();
+        return lastPage;
+    }
+
+    /// Allocated pages by page number
+    std::unordered_map<uint64_t, std::unique_ptr<BTH_entry[]>> pageMap;
+
+    /// Most recently used page
+    mutable uint64_t lastPageNum;
+    mutable BTH_entry *lastPage;
+};
+
+#endif // __LEARNING_GEM5_DBRC_L0T_HH__
@@ -0,0 +1,411 @@
+#ifndef __LEARNING_GEM5_DBRC_REPLACEMENT_HH__
+#define __LEARNING_GEM5_DBRC_REPLACEMENT_HH__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "dbrc_dba.hh"
+#include "dbrc_entries.hh"
+
+/**
+ * Selects the DBA entries to replace. The DBA is split into slices, one per
+ * bank, and a victim is always taken from the slice of the bank the block
+ * goes to.
+ *
+ * Every policy takes entries that are invalid or have no parent (PV
+ * cleared) first, and never takes a locked entry, one on the path being
+ * installed or one that drops more blocks than the drop limit. The walk of
+ * the tree increments the R counter of the tables and blocks it reaches.
+ * Policies that keep their own state fold R into it when they look at an
+ * entry.
+ *
+ * The state of a policy, other than the DUT, is a flat array of bytes so
+ * that it can be checkpointed. This class does not depend on gem5 so the
+ * standalone trace simulator can use it as well.
+ */
+class DbrcReplacement
+{
+  public:
+    enum : uint32_t { NoVictim = ~0u };
+
+    /// No bound on the blocks a replaced table drops, see setDropLimit()
+    enum : uint32_t { NoLimit = ~0u };
+
+    /// The result of a victim search
+    struct Victim
+    {
+        /// Entry to replace, NoVictim if every entry is locked
+        uint32_t index;
+
+        /// Replaceable entries examined
+        unsigned attempts;
+
+        /// True if the search gave up and took the best entry it saw
+        bool fallback;
+    };
+
+    DbrcReplacement(DbrcDBA &dba, size_t state_bytes) :
+        dba(dba), state(state_bytes, 0), dropLimit(NoLimit)
+    { }
+
+    virtual ~DbrcReplacement() { }
+
+    /// A table or data block of a level was installed in an entry
+    virtual void reset(uint32_t index, unsigned level) { }
+
+    /// The data block of an entry was accessed
+    virtual void touch(uint32_t index) { }
+
+    /**
+     * Select the entry of a slice to replace.
+     *
+     * @param base first entry of the slice
+     * @param size number of entries of the slice
+     * @param hand clock hand within the slice, left on the victim
+     * @param path entries that must not be replaced
+     */
+    virtual Victim getVictim(uint32_t base, uint32_t size, uint32_t &hand,
+                             const std::vector<uint32_t> &path) = 0;
+
+    /**
+     * Only replace entries that drop at most limit blocks, see dropCost(),
+     * until the next call. A limit of at least 1 keeps every data block
+     * replaceable.
+     */
+    void setDropLimit(uint32_t limit) { dropLimit = limit; }
+
+    /**
+     * Count the blocks that replacing an entry drops and that are dirty or
+     * cached above, i.e. that have to be written back or back-invalidated.
+     * These are the entry itself if it is a data block, or the data blocks
+     * of its subtree if it is a table. Tables are never dirty nor cached
+     * above, and the BTH table of a data block is cleared when it is
+     * installed, so the levels need not be known.
+     *
+     * @param limit stop counting once past it
+     */
+    uint32_t
+    dropCost(uint32_t index, uint32_t limit = NoLimit) const
+    {
+        const DUT_entry &dut = dba.dut(index);
+        if (!dut.V)
+            return 0;
+        uint32_t cost = dut.D || dut.C;
+        const BTH_entry *children = dba.bth(index);
+        for (unsigned i = 0; i < dba.tableEntries() && cost <= limit; i++) {
+            if (children[i].V)
+                cost += dropCost(children[i].I, limit - cost);
+        }
+        return cost;
+    }
+
+    /// State of the policy, for checkpoints
+    std::vector<uint8_t> &rawState() { return state; }
+    const std::vector<uint8_t> &rawState() const { return state; }
+
+  protected:
+    bool
+    replaceable(uint32_t index, const std::vector<uint32_t> &path) const
+    {
+        return !dba.dut(index).L &&
+               std::find(path.begin(), path.end(), index) == path.end() &&
+               (dropLimit == NoLimit ||
+                dropCost(index, dropLimit) <= dropLimit);
+    }
+
+    /// True if an entry can be replaced without losing anything useful
+    static bool unused(const DUT_entry &dut) { return !dut.V || !dut.PV; }
+
+    static void
+    advance(uint32_t &hand, uint32_t base, uint32_t size)
+    {
+        if (++hand >= base + size)
+            hand = base;
+    }
+
+    DbrcDBA &dba;
+    std::vector<uint8_t> state;
+
+    uint32_t dropLimit;
+};
+
+/**
+ * The original DBRC policy. The VBIR clock hand takes the first entry not
+ * reused since its last pass, clearing R on the way. After MNA attempts it
+ * takes the entry with the smallest R.
+ */
+class DbrcClockReplacement : public DbrcReplacement
+{
+  public:
+    DbrcClockReplacement(DbrcDBA &dba, unsigned mna) :
+        DbrcReplacement(dba, 0), mna(mna)
+    { }
+
+    Victim
+    getVictim(uint32_t base, uint32_t size, uint32_t &hand,
+              const std::vector<uint32_t> &path) override
+    {
+        unsigned attempts = 0;
+        uint64_t steps = 0;
+        uint32_t smallest_r_idx = NoVictim;
+        uint32_t smallest_r = 33;
+
+        while (attempts < mna) {
+            if (++steps > 2 * (uint64_t)size)
+                return {NoVictim, attempts, false};
+
+            if (replaceable(hand, path)) {
+                DUT_entry &dut = dba.dut(hand);
+                if (unused(dut) || dut.R == 0)
+                    return {hand, attempts + 1, false};
+
+                if (dut.R < smallest_r) {
+                    smallest_r_idx = hand;
+                    smallest_r = dut.R;
+                }
+                dut.R = 0;
+                attempts++;
+            }
+            advance(hand, base, size);
+        }
+
+        hand = smallest_r_idx;
+        return {hand, attempts, true};
+    }
+
+  private:
+    const unsigned mna;
+};
+
+/**
+ * Static and bimodal re-reference interval prediction (SRRIP and BRRIP).
+ * Each entry has a 2 bit RRPV. Accessed blocks, and tables the walk went
+ * through, are predicted to be re-referenced soon (0). SRRIP installs at 2,
+ * BRRIP at 3 but for one install in 32. The hand takes the first entry at
+ * 3, aging the entries it passes.
+ */
+class DbrcRRIPReplacement : public DbrcReplacement
+{
+  public:
+    DbrcRRIPReplacement(DbrcDBA &dba, bool bimodal) :
+        DbrcReplacement(dba, dba.size()), bimodal(bimodal), seed(0x2545f491)
+    {
+        std::fill(state.begin(), state.end(), MaxRRPV);
+    }
+
+    void
+    reset(uint32_t index, unsigned level) override
+    {
+        // Only the walks after the install count as references
+        dba.dut(index).R = 0;
+        state[index] = bimodal && (nextRandom() & 31) ? MaxRRPV : MaxRRPV - 1;
+    }
+
+    void touch(uint32_t index) override { state[index] = 0; }
+
+    Victim
+    getVictim(uint32_t base, uint32_t size, uint32_t &hand,
+              const std::vector<uint32_t> &path) override
+    {
+        unsigned attempts = 0;
+        // Every pass ages all entries, so this ends after MaxRRPV + 1
+        // passes, and one more to clear R
+        for (uint64_t steps = 0; steps < (MaxRRPV + 2) * (uint64_t)size;
+             steps++) {
+            if (replaceable(hand, path)) {
+                attempts++;
+                DUT_entry &dut = dba.dut(hand);
+                if (unused(dut))
+                    return {hand, attempts, false};
+                if (dut.R > 0) {
+                    // Reached by a walk since the last pass
+                    dut.R = 0;
+                    state[hand] = 0;
+                }
+                if (state[hand] == MaxRRPV)
+                    return {hand, attempts, false};
+                state[hand]++;
+            }
+            advance(hand, base, size);
+        }
+        return {NoVictim, attempts, false};
+    }
+
+  private:
+    enum : uint8_t { MaxRRPV = 3 };
+
+    /// xorshift, deterministic so that runs are reproducible
+    uint32_t
+    nextRandom()
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    const bool bimodal;
+    uint32_t seed;
+};
+
+/**
+ * Tree pseudo-LRU. Each slice has a binary tree over its entries, rounded
+ * up to a power of two, whose nodes point away from the most recently used
+ * half. Installs and accesses update the tree. An entry the walk reached
+ * since it was last considered is made the most recently used instead of
+ * being replaced.
+ *
+ * The trees are over the slices, i.e. the DBA entries of a bank, rather
+ * than over L0T regions. Entries are not tied to a region: any entry of a
+ * bank may hold a table or block of any region, and the victim has to come
+ * from the slice of the bank the install goes to, so a tree per region
+ * would need its leaves remapped on every install and could not pick a
+ * victim for a region that holds no entries yet.
+ */
+class DbrcTreePLRUReplacement : public DbrcReplacement
+{
+  public:
+    DbrcTreePLRUReplacement(DbrcDBA &dba, uint32_t slice_size) :
+        DbrcReplacement(dba, 0), sliceSize(slice_size), leaves(1)
+    {
+        while (leaves < sliceSize)
+            leaves *= 2;
+        // Node 0 of each tree is unused, the root is node 1
+        state.resize(dba.size() / sliceSize * leaves);
+    }
+
+    void
+    reset(uint32_t index, unsigned level) override
+    {
+        // Only the walks after the install count as references
+        dba.dut(index).R = 0;
+        touch(index);
+    }
+
+    void
+    touch(uint32_t index) override
+    {
+        uint8_t *tree = &state[index / sliceSize * leaves];
+        for (uint32_t node = leaves + index % sliceSize; node > 1;
+             node /= 2) {
+            // Point the parent to the other child
+            tree[node / 2] = !(node & 1);
+        }
+    }
+
+    Victim
+    getVictim(uint32_t base, uint32_t size, uint32_t &hand,
+              const std::vector<uint32_t> &path) override
+    {
+        const uint8_t *tree = &state[base / sliceSize * leaves];
+        unsigned attempts = 0;
+        for (uint64_t steps = 0; steps < 3 * (uint64_t)size; steps++) {
+            uint32_t node = 1;
+            while (node < leaves) {
+                uint32_t child = 2 * node + tree[node];
+                // Skip the padding leaves past the end of the slice
+                if (firstLeaf(child) >= size)
+                    child = 2 * node;
+                node = child;
+            }
+            uint32_t index = base + node - leaves;
+
+            if (replaceable(index, path)) {
+                attempts++;
+                DUT_entry &dut = dba.dut(index);
+                if (unused(dut) || dut.R == 0) {
+                    hand = index;
+                    return {index, attempts, false};
+                }
+                dut.R = 0;
+            }
+            touch(index);
+        }
+        return {NoVictim, attempts, false};
+    }
+
+  private:
+    /// Leftmost leaf under a node, relative to the slice
+    uint32_t
+    firstLeaf(uint32_t node) const
+    {
+        while (node < leaves)
+            node *= 2;
+        return node - leaves;
+    }
+
+    const uint32_t sliceSize;
+    uint32_t leaves;
+};
+
+/**
+ * The clock policy, made aware of the level of the tables. A table at
+ * level N survives num_BTH - N extra passes of the hand without being
+ * reused, since losing it drops the whole subtree below it. The extra
+ * passes are given back whenever the hand finds the table reused. After
+ * MNA attempts the entry with the smallest R is taken, the deepest one
+ * on a tie.
+ */
+class DbrcLevelAwareReplacement : public DbrcReplacement
+{
+  public:
+    DbrcLevelAwareReplacement(DbrcDBA &dba, unsigned mna, unsigned num_BTH) :
+        DbrcReplacement(dba, dba.size()), mna(mna), numBTH(num_BTH)
+    { }
+
+    void
+    reset(uint32_t index, unsigned level) override
+    {
+        state[index] = numBTH - level;
+    }
+
+    Victim
+    getVictim(uint32_t base, uint32_t size, uint32_t &hand,
+              const std::vector<uint32_t> &path) override
+    {
+        unsigned attempts = 0;
+        uint64_t steps = 0;
+        uint32_t best_idx = NoVictim;
+        unsigned best_r = 33;
+        unsigned best_level = 0;
+
+        while (attempts < mna) {
+            if (++steps > 2 * (uint64_t)size)
+                return {NoVictim, attempts, false};
+
+            if (replaceable(hand, path)) {
+                DUT_entry &dut = dba.dut(hand);
+                if (unused(dut))
+                    return {hand, attempts + 1, false};
+                if (dut.R == 0) {
+                    if (state[hand] == 0)
+                        return {hand, attempts + 1, false};
+                    state[hand]--;
+                } else {
+                    state[hand] = numBTH - dut.LF;
+                }
+
+                if (dut.R < best_r ||
+                    (dut.R == best_r && dut.LF > best_level)) {
+                    best_idx = hand;
+                    best_r = dut.R;
+                    best_level = dut.LF;
+                }
+                dut.R = 0;
+                attempts++;
+            }
+            advance(hand, base, size);
+        }
+
+        hand = best_idx;
+        return {hand, attempts, true};
+    }
+
+  private:
+    const unsigned mna;
+    const unsigned numBTH;
+};
+
+#endif // __LEARNING_GEM5_DBRC_REPLACEMENT_HH__
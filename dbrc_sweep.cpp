@@ -0,0 +1,421 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dbrc_core.hh"
+#include "dbrc_trace.hh"
+
+typedef uint64_t Addr;
+
+/// Block addresses decoded at once and replayed by every DBRC in lockstep
+const size_t BatchSize = 1 << 20;
+
+/// One point of the sweep and what the replay gave
+struct SweepPoint
+{
+    uint64_t size;
+    unsigned num_BTH;
+    unsigned TLB_size;
+    unsigned MNA;
+
+    std::unique_ptr<DbrcCore> core;
+    uint64_t accesses;
+    uint64_t misses;
+    uint64_t tlbHits;
+    double seconds;
+};
+
+/**
+ * @brief Decodes a trace a batch at a time while the worker threads replay
+ * the previous batch through their DBRCs.
+ *
+ * @details
+ *      Two batches are in memory, one being decoded, one being replayed.
+ *      The workers all start a batch together and the decoder waits for
+ *      the last of them before it hands them the next one, so every DBRC
+ *      sees the trace once and in order.
+ */
+class LockstepReplay
+{
+  public:
+    LockstepReplay(DbrcTraceReader &trace, std::vector<SweepPoint> &points,
+                   unsigned num_threads, unsigned block_size) :
+        trace(trace), points(points), numThreads(num_threads),
+        blockSize(block_size), generation(0), running(0)
+    {
+        for (auto &batch : batches)
+            batch.reserve(BatchSize);
+    }
+
+    /// Replay the whole trace, return the number of accesses
+    uint64_t
+    run()
+    {
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < numThreads; t++)
+            workers.emplace_back(&LockstepReplay::work, this, t);
+
+        uint64_t total = 0;
+        try {
+            total = decode(batches[0]);
+            while (true) {
+                const std::vector<Addr> &current = batches[generation % 2];
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    generation++;
+                    running = numThreads;
+                }
+                cond.notify_all();
+                if (current.empty())
+                    break;
+
+                // Decode the next batch while the workers replay this one
+                total += decode(batches[generation % 2]);
+
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return running == 0; });
+            }
+        } catch (...) {
+            // The trace is bad. Let the workers finish their batch and hand
+            // them an empty one, which stops them, before giving up.
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [this] { return running == 0; });
+                batches[generation % 2].clear();
+                generation++;
+            }
+            cond.notify_all();
+            for (auto &worker : workers)
+                worker.join();
+            throw;
+        }
+
+        for (auto &worker : workers)
+            worker.join();
+        return total;
+    }
+
+  private:
+    size_t
+    decode(std::vector<Addr> &batch)
+    {
+        batch.clear();
+        DbrcTraceRecord record;
+        while (batch.size() < BatchSize && trace.next(record))
+            batch.push_back(record.addr & ~Addr(blockSize - 1));
+        return batch.size();
+    }
+
+    /// Body of worker t, it replays every numThreads-th point
+    void
+    work(unsigned t)
+    {
+        std::vector<uint8_t> block(blockSize, 0);
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait(lock, [&] { return generation > seen; });
+                seen = generation;
+            }
+            const std::vector<Addr> &batch = batches[(seen - 1) % 2];
+            if (batch.empty())
+                return;
+
+            for (size_t p = t; p < points.size(); p += numThreads)
+                replay(points[p], batch, block);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--running == 0)
+                cond.notify_all();
+        }
+    }
+
+    static void
+    replay(SweepPoint &point, const std::vector<Addr> &batch,
+           std::vector<uint8_t> &block)
+    {
+        auto start = std::chrono::steady_clock::now();
+        DbrcCore &core = *point.core;
+        for (Addr block_addr : batch) {
+            DbrcCore::Lookup found = core.lookup(block_addr);
+            point.tlbHits += found.tlbHit;
+            if (!found.found) {
+                uint32_t index;
+                core.insert(block_addr, block.data(), false, index);
+                point.misses++;
+            }
+        }
+        point.accesses += batch.size();
+        point.seconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    DbrcTraceReader &trace;
+    std::vector<SweepPoint> &points;
+    const unsigned numThreads;
+    const unsigned blockSize;
+
+    std::vector<Addr> batches[2];
+
+    std::mutex mutex;
+    std::condition_variable cond;
+
+    /// Batches handed to the workers so far, the last one is
+    /// batches[(generation - 1) % 2]
+    uint64_t generation;
+
+    /// Workers still replaying the last batch
+    unsigned running;
+};
+
+/// Parse a size such as 64kB, 1MB or 4096
+uint64_t
+parseSize(const std::string &text)
+{
+    char *suffix;
+    uint64_t value = strtoull(text.c_str(), &suffix, 0);
+    if (suffix == text.c_str())
+        throw std::runtime_error("Bad size '" + text + "'");
+    std::string unit(suffix);
+    if (unit == "kB" || unit == "KB" || unit == "KiB")
+        return value << 10;
+    if (unit == "MB" || unit == "MiB")
+        return value << 20;
+    if (unit == "GB" || unit == "GiB")
+        return value << 30;
+    if (unit == "" || unit == "B")
+        return value;
+    throw std::runtime_error("Bad size '" + text + "'");
+}
+
+/// Parse a comma separated list of values
+std::vector<uint64_t>
+parseList(const std::string &text)
+{
+    std::vector<uint64_t> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        values.push_back(parseSize(item));
+    if (values.empty())
+        throw std::runtime_error("Empty list");
+    return values;
+}
+
+/// Why a point can't be simulated, empty if it can. See the checks of the
+/// DbrcCache constructor.
+std::string
+checkPoint(const DbrcCore::Config &config)
+{
+    if (config.capacity == 0)
+        return "the cache is smaller than a block";
+    if (config.numBTH == 0)
+        return "there are no BTH levels";
+    if (DbrcGeometry(config.blockSize, config.numBTH).regionShift() >= 64)
+        return "the BTH levels cover more than 64 bits";
+    if (config.tlbAssoc == 0 || config.tlbSize % config.tlbAssoc != 0)
+        return "the TLB ways don't divide the TLB";
+    unsigned sets = config.tlbSize / config.tlbAssoc;
+    if (sets & (sets - 1))
+        return "the number of TLB sets is not a power of two";
+    if (config.mna == 0)
+        return "MNA is 0";
+    if (config.capacity < config.numBTH)
+        return "the cache can't hold a path";
+    return "";
+}
+
+void
+writeCSV(std::ostream &out, const std::vector<SweepPoint> &points)
+{
+    out << "size,num_BTH,TLB_size,MNA,accesses,misses,miss_ratio,tlb_hits,"
+           "seconds" << std::endl;
+    for (const auto &point : points) {
+        out << point.size << "," << point.num_BTH << "," << point.TLB_size
+            << "," << point.MNA << "," << point.accesses << ","
+            << point.misses << ","
+            << (point.accesses ? double(point.misses) / point.accesses : 0)
+            << "," << point.tlbHits << "," << point.seconds << std::endl;
+    }
+}
+
+void
+writeJSON(std::ostream &out, const std::vector<SweepPoint> &points)
+{
+    out << "[" << std::endl;
+    for (size_t i = 0; i < points.size(); i++) {
+        const SweepPoint &point = points[i];
+        out << "  {\"size\": " << point.size
+            << ", \"num_BTH\": " << point.num_BTH
+            << ", \"TLB_size\": " << point.TLB_size
+            << ", \"MNA\": " << point.MNA
+            << ", \"accesses\": " << point.accesses
+            << ", \"misses\": " << point.misses
+            << ", \"miss_ratio\": "
+            << (point.accesses ? double(point.misses) / point.accesses : 0)
+            << ", \"tlb_hits\": " << point.tlbHits
+            << ", \"seconds\": " << point.seconds << "}"
+            << (i + 1 < points.size() ? "," : "") << std::endl;
+    }
+    out << "]" << std::endl;
+}
+
+void
+usage(const char *name)
+{
+    std::cerr << "Usage: " << name << " [options] <binary trace>" << std::endl
+              << "Replays a trace through every combination of the values "
+              << "below, comma separated" << std::endl
+              << "  --size LIST       cache sizes (1MB)" << std::endl
+              << "  --num-bth LIST    BTH levels (3)" << std::endl
+              << "  --tlb-size LIST   TLB entries (65536)" << std::endl
+              << "  --mna LIST        replacement attempts (5)" << std::endl
+              << "  --tlb-assoc N     TLB ways (8)" << std::endl
+              << "  --block-size N    block size in bytes (64)" << std::endl
+              << "  --threads N       worker threads (one per core)"
+              << std::endl
+              << "  --output FILE     results, JSON if FILE ends in .json, "
+              << "CSV otherwise (CSV on stdout)" << std::endl;
+}
+
+/**
+ * @brief Sweeps DBRC configurations over a trace. The trace is decoded once
+ * and every configuration replays it on a pool of threads, one DBRC each,
+ * like test.cpp does for one configuration.
+ */
+int main(int argc, char **argv)
+{
+    std::vector<uint64_t> sizes = {1 << 20}, num_BTHs = {3};
+    std::vector<uint64_t> TLB_sizes = {1 << 16}, MNAs = {5};
+    unsigned TLB_assoc = 8;
+    unsigned blockSize = 64;
+    unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string output, filename;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg.compare(0, 2, "--") != 0) {
+                if (!filename.empty())
+                    throw std::runtime_error("More than one trace");
+                filename = arg;
+                continue;
+            }
+            if (i + 1 == argc)
+                throw std::runtime_error("No value for " + arg);
+            std::string value = argv[++i];
+            if (arg == "--size")
+                sizes = parseList(value);
+            else if (arg == "--num-bth")
+                num_BTHs = parseList(value);
+            else if (arg == "--tlb-size")
+                TLB_sizes = parseList(value);
+            else if (arg == "--mna")
+                MNAs = parseList(value);
+            else if (arg == "--tlb-assoc")
+                TLB_assoc = parseSize(value);
+            else if (arg == "--block-size")
+                blockSize = parseSize(value);
+            else if (arg == "--threads")
+                num_threads = std::max<uint64_t>(1, parseSize(value));
+            else if (arg == "--output")
+                output = value;
+            else
+                throw std::runtime_error("Unknown option " + arg);
+        }
+        if (filename.empty())
+            throw std::runtime_error("No trace");
+        if (blockSize < 2 || (blockSize & (blockSize - 1)))
+            throw std::runtime_error("The block size must be a power of two");
+    } catch (const std::runtime_error &e) {
+        std::cerr << e.what() << std::endl;
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<SweepPoint> points;
+    for (uint64_t size : sizes)
+    for (uint64_t num_BTH : num_BTHs)
+    for (uint64_t TLB_size : TLB_sizes)
+    for (uint64_t MNA : MNAs)
+    {
+        DbrcCore::Config config;
+        config.blockSize = blockSize;
+        config.capacity = size / blockSize;
+        config.numBanks = 1;
+        config.numBTH = num_BTH;
+        // Only data blocks go to the TLB
+        config.targetBTH = num_BTH;
+        config.tlbSize = TLB_size;
+        config.tlbAssoc = TLB_assoc;
+        config.mna = MNA;
+        config.policy = DbrcCore::Clock;
+        config.maxLockedPerBank = 0;
+
+        std::string problem = checkPoint(config);
+        if (!problem.empty()) {
+            std::cerr << "Skipping size " << size << ", num_BTH " << num_BTH
+                      << ", TLB_size " << TLB_size << ", MNA " << MNA
+                      << ": " << problem << std::endl;
+            continue;
+        }
+
+        SweepPoint point = {size, unsigned(num_BTH), unsigned(TLB_size),
+                            unsigned(MNA), nullptr, 0, 0, 0, 0};
+        point.core.reset(new DbrcCore(config));
+        points.push_back(std::move(point));
+    }
+    if (points.empty()) {
+        std::cerr << "Nothing to sweep" << std::endl;
+        return 1;
+    }
+    num_threads = std::min<size_t>(num_threads, points.size());
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t total;
+    try {
+        DbrcTraceReader trace(filename);
+        LockstepReplay replay(trace, points, num_threads, blockSize);
+        total = replay.run();
+    } catch (const std::runtime_error &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    std::cerr << points.size() << " configurations of " << total
+              << " accesses on " << num_threads << " threads in " << seconds
+              << "s" << std::endl;
+
+    if (output.empty()) {
+        writeCSV(std::cout, points);
+        return 0;
+    }
+    std::ofstream out(output);
+    if (!out) {
+        std::cerr << "Can't create '" << output << "'" << std::endl;
+        return 1;
+    }
+    bool json = output.size() > 5 &&
+                output.compare(output.size() - 5, 5, ".json") == 0;
+    if (json)
+        writeJSON(out, points);
+    else
+        writeCSV(out, points);
+    return 0;
+}
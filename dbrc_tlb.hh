@@ -0,0 +1,208 @@
+#ifndef __LEARNING_GEM5_DBRC_TLB_HH__
+#define __LEARNING_GEM5_DBRC_TLB_HH__
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * B-TLB of the DBRC. Maps the tag of a data block to the DBA entry holding
+ * it. Set-associative with LRU replacement within a set.
+ *
+ * All entries live in one flat array, set after set. The ways of a set are
+ * kept in recency order, most recently used first, and the valid ones form
+ * a prefix of the set. A lookup is a short linear scan of one set indexed
+ * by the low bits of the key, with no hashing and no memory allocated after
+ * construction.
+ *
+ * This class does not depend on gem5 so the standalone trace simulator can
+ * use it as well.
+ */
+class DbrcTLB
+{
+  public:
+    typedef uint64_t Key;
+    typedef uint32_t Value;
+
+    /**
+     * @param capacity number of entries. A capacity of 0 disables the TLB.
+     * @param assoc number of ways. capacity / assoc must be a power of two.
+     */
+    DbrcTLB(size_t capacity, unsigned assoc) :
+        numWays(capacity ? std::min<size_t>(assoc, capacity) : 0),
+        numSets(numWays ? capacity / numWays : 0),
+        entries(numSets * numWays), setSize(numSets, 0), count(0)
+    {
+        assert(numWays == 0 || capacity % numWays == 0);
+        assert((numSets & (numSets - 1)) == 0);
+    }
+
+    /**
+     * Look up a key and make it the most recently used entry of its set.
+     *
+     * @return true if found, value is set to the mapped value
+     */
+    bool
+    lookup(Key key, Value &value)
+    {
+        if (numSets == 0)
+            return false;
+        Entry *set = setOf(key);
+        unsigned way = findWay(set, setSize[setIndex(key)], key);
+        if (way == NotFound)
+            return false;
+        value = set[way].value;
+        promote(set, way);
+        return true;
+    }
+
+    /// True if key is mapped. Does not change the LRU order.
+    bool
+    contains(Key key) const
+    {
+        if (numSets == 0)
+            return false;
+        const Entry *set = &entries[setIndex(key) * numWays];
+        return findWay(set, setSize[setIndex(key)], key) != NotFound;
+    }
+
+    /**
+     * Map key to value as the most recently used entry of its set. If the
+     * set is full its least recently used entry is evicted.
+     *
+     * @return true if an entry had to be evicted
+     */
+    bool
+    insert(Key key, Value value)
+    {
+        if (numSets == 0)
+            return false;
+
+        Entry *set = setOf(key);
+        uint32_t &n = setSize[setIndex(key)];
+        unsigned way = findWay(set, n, key);
+        if (way != NotFound) {
+            set[way].value = value;
+            promote(set, way);
+            return false;
+        }
+
+        bool evicted = n == numWays;
+        if (!evicted) {
+            n++;
+            count++;
+        }
+        // Age every entry by one way, dropping the LRU one if full
+        std::copy_backward(set, set + n - 1, set + n);
+        set[0].key = key;
+        set[0].value = value;
+
+        return evicted;
+    }
+
+    /**
+     * Remove a key if it is mapped.
+     *
+     * @return true if the key was mapped
+     */
+    bool
+    erase(Key key)
+    {
+        if (numSets == 0)
+            return false;
+        Entry *set = setOf(key);
+        uint32_t &n = setSize[setIndex(key)];
+        unsigned way = findWay(set, n, key);
+        if (way == NotFound)
+            return false;
+        std::copy(set + way + 1, set + n, set + way);
+        n--;
+        count--;
+        return true;
+    }
+
+    /// Number of valid entries
+    size_t size() const { return count; }
+
+    /// Maximum number of entries
+    size_t capacity() const { return entries.size(); }
+
+    /// Number of ways of a set
+    size_t assoc() const { return numWays; }
+
+    /**
+     * Call f(key, value) for every entry, the least recently used ways of
+     * all sets first. Inserting them again in that order restores the LRU
+     * order of every set.
+     */
+    template <typename F>
+    void
+    forEachLRU(F f) const
+    {
+        for (size_t way = numWays; way-- > 0; ) {
+            for (size_t set = 0; set < numSets; set++) {
+                if (way < setSize[set]) {
+                    const Entry &e = entries[set * numWays + way];
+                    f(e.key, e.value);
+                }
+            }
+        }
+    }
+
+    /// Remove all entries
+    void
+    clear()
+    {
+        std::fill(setSize.begin(), setSize.end(), 0);
+        count = 0;
+    }
+
+  private:
+    enum : unsigned { NotFound = ~0u };
+
+    struct Entry
+    {
+        Key key;
+        Value value;
+    };
+
+    size_t setIndex(Key key) const { return key & (numSets - 1); }
+
+    Entry *setOf(Key key) { return &entries[setIndex(key) * numWays]; }
+
+    static unsigned
+    findWay(const Entry *set, unsigned n, Key key)
+    {
+        for (unsigned way = 0; way < n; way++) {
+            if (set[way].key == key)
+                return way;
+        }
+        return NotFound;
+    }
+
+    /// Make a way the most recently used of its set
+    static void
+    promote(Entry *set, unsigned way)
+    {
+        if (way == 0)
+            return;
+        Entry e = set[way];
+        std::copy_backward(set, set + way, set + way + 1);
+        set[0] = e;
+    }
+
+    const size_t numWays;
+    const size_t numSets;
+
+    /// numSets sets of numWays entries, each in recency order
+    std::vector<Entry> entries;
+
+    /// Valid entries of each set
+    std::vector<uint32_t> setSize;
+
+    size_t count;
+};
+
+#endif // __LEARNING_GEM5_DBRC_TLB_HH__
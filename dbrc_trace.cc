@@ -0,0 +1,375 @@
+#include "dbrc_trace.hh"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+
+const size_t WriteBufferBytes = 1 << 20;
+
+/// Append a varint to a buffer with room for it
+uint8_t *
+putVarint(uint8_t *p, uint64_t value)
+{
+    while (value >= 0x80) {
+        *p++ = uint8_t(value) | 0x80;
+        value >>= 7;
+    }
+    *p++ = uint8_t(value);
+    return p;
+}
+
+/// First bytes of a gzip stream
+bool
+isGzip(const uint8_t *header)
+{
+    return header[0] == 0x1f && header[1] == 0x8b;
+}
+
+} // anonymous namespace
+
+DbrcTraceWriter::DbrcTraceWriter(const std::string &filename,
+                                 bool compress, bool timed) :
+    filename(filename), timed(timed), file(nullptr), gzfile(nullptr),
+    buffer(WriteBufferBytes), used(0), lastAddr(0), lastRequestor(0),
+    lastTick(0), count(0)
+{
+    if (compress)
+        gzfile = gzopen(filename.c_str(), "wb1");
+    else
+        file = fopen(filename.c_str(), "wb");
+    if (!file && !gzfile)
+        throw std::runtime_error("Can't create trace '" + filename + "'");
+
+    uint8_t header[DbrcTrace::HeaderBytes] = {};
+    memcpy(header, DbrcTrace::Magic, sizeof(DbrcTrace::Magic));
+    uint32_t version = DbrcTrace::Version;
+    uint32_t flags = timed ? DbrcTrace::Timed : 0;
+    memcpy(header + 8, &version, sizeof(version));
+    memcpy(header + 12, &flags, sizeof(flags));
+    put(header, sizeof(header));
+}
+
+DbrcTraceWriter::~DbrcTraceWriter()
+{
+    // Errors can only be reported by an explicit close()
+    try {
+        close();
+    } catch (const std::runtime_error &) {
+    }
+}
+
+void
+DbrcTraceWriter::write(const DbrcTraceRecord &record)
+{
+    if (buffer.size() - used < DbrcTrace::MaxRecordBytes)
+        flush();
+
+    uint8_t *start = buffer.data() + used;
+    uint8_t *p = start + 1;
+
+    uint8_t flags = record.write ? DbrcTrace::WriteFlag : 0;
+    flags |= std::min(record.size, DbrcTrace::SizeEscape) <<
+             DbrcTrace::SizeShift;
+    if (record.requestor != lastRequestor)
+        flags |= DbrcTrace::RequestorFlag;
+    *start = flags;
+
+    int64_t delta = record.addr - lastAddr;
+    p = putVarint(p, (uint64_t(delta) << 1) ^ uint64_t(delta >> 63));
+    if (record.size >= DbrcTrace::SizeEscape)
+        p = putVarint(p, record.size);
+    if (record.requestor != lastRequestor)
+        p = putVarint(p, record.requestor);
+    if (timed) {
+        // Ticks never go back
+        p = putVarint(p, record.tick - lastTick);
+        *p++ = record.cmd;
+        lastTick = record.tick;
+    }
+
+    used = p - buffer.data();
+    lastAddr = record.addr;
+    lastRequestor = record.requestor;
+    count++;
+}
+
+void
+DbrcTraceWriter::put(const void *data, size_t bytes)
+{
+    if (buffer.size() - used < bytes)
+        flush();
+    memcpy(buffer.data() + used, data, bytes);
+    used += bytes;
+}
+
+void
+DbrcTraceWriter::flush()
+{
+    if (used == 0)
+        return;
+    bool ok = gzfile ? gzwrite(gzfile, buffer.data(), used) == (int)used :
+                       fwrite(buffer.data(), 1, used, file) == used;
+    used = 0;
+    if (!ok)
+        throw std::runtime_error("Write failed on trace '" + filename + "'");
+}
+
+void
+DbrcTraceWriter::close()
+{
+    if (!file && !gzfile)
+        return;
+    flush();
+    bool ok = gzfile ? gzclose(gzfile) == Z_OK : fclose(file) == 0;
+    file = nullptr;
+    gzfile = nullptr;
+    if (!ok)
+        throw std::runtime_error("Close failed on trace '" + filename + "'");
+}
+
+const size_t DbrcTraceReader::ReadAhead;
+const size_t DbrcTraceReader::ChunkBytes;
+
+DbrcTraceReader::DbrcTraceReader(const std::string &filename) :
+    filename(filename), map(nullptr), mapBytes(0), advised(nullptr),
+    gzfile(nullptr), eof(false), cur(nullptr), safe(nullptr), end(nullptr),
+    timed(false), lastAddr(0), lastRequestor(0), lastTick(0)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Can't open trace '" + filename + "'");
+
+    uint8_t header[DbrcTrace::HeaderBytes];
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(header) ||
+        pread(fd, header, sizeof(header), 0) != sizeof(header)) {
+        ::close(fd);
+        corrupt();
+    }
+
+    if (isGzip(header)) {
+        // Let zlib read the file from the start, header included
+        gzfile = gzdopen(fd, "rb");
+        if (!gzfile) {
+            ::close(fd);
+            throw std::runtime_error("Can't open trace '" + filename + "'");
+        }
+        gzbuffer(gzfile, ChunkBytes);
+        chunk.resize(ChunkBytes + DbrcTrace::MaxRecordBytes);
+        cur = safe = end = chunk.data();
+        if (gzread(gzfile, header, sizeof(header)) != sizeof(header))
+            memset(header, 0, sizeof(header));
+    } else {
+        mapBytes = st.st_size;
+        void *addr = mmap(nullptr, mapBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error("Can't map trace '" + filename + "'");
+        map = static_cast<uint8_t *>(addr);
+        madvise(map, mapBytes, MADV_SEQUENTIAL);
+
+        cur = safe = map + sizeof(header);
+        end = map + mapBytes;
+        advised = map;
+    }
+
+    uint32_t version, flags;
+    memcpy(&version, header + 8, sizeof(version));
+    memcpy(&flags, header + 12, sizeof(flags));
+    timed = flags & DbrcTrace::Timed;
+    if (memcmp(header, DbrcTrace::Magic, sizeof(DbrcTrace::Magic)) != 0 ||
+        version != DbrcTrace::Version) {
+        if (map)
+            munmap(map, mapBytes);
+        if (gzfile)
+            gzclose(gzfile);
+        throw std::runtime_error("'" + filename + "' is not a version " +
+                                 std::to_string(DbrcTrace::Version) +
+                                 " DBRC trace");
+    }
+}
+
+DbrcTraceReader::~DbrcTraceReader()
+{
+    if (map)
+        munmap(map, mapBytes);
+    if (gzfile)
+        gzclose(gzfile);
+}
+
+bool
+DbrcTraceReader::refill()
+{
+    if (eof)
+        return false;
+
+    if (map) {
+        const uint8_t *map_end = map + mapBytes;
+        // Keep one to two windows ahead of the decoding in the page cache
+        while (advised < map_end && advised - cur < (ptrdiff_t)ReadAhead) {
+            size_t bytes = std::min<size_t>(ReadAhead, map_end - advised);
+            madvise(const_cast<uint8_t *>(advised), bytes, MADV_WILLNEED);
+            advised += bytes;
+        }
+
+        if (map_end - cur > (ptrdiff_t)DbrcTrace::MaxRecordBytes) {
+            safe = std::min(advised, map_end - DbrcTrace::MaxRecordBytes);
+            return true;
+        }
+
+        // The last records, decoded from a padded copy
+        size_t left = map_end - cur;
+        chunk.assign(left + DbrcTrace::MaxRecordBytes, 0);
+        std::copy(cur, map_end, chunk.begin());
+        cur = chunk.data();
+        safe = end = cur + left;
+        eof = true;
+        return cur < end;
+    }
+
+    // Keep what is left of the chunk and inflate more after it
+    size_t left = end - cur;
+    std::copy(cur, end, chunk.begin());
+    cur = chunk.data();
+    end = cur + left;
+    while (!eof && end - cur < (ptrdiff_t)DbrcTrace::MaxRecordBytes) {
+        int bytes = gzread(gzfile, const_cast<uint8_t *>(end),
+                           ChunkBytes - left);
+        if (bytes < 0)
+            corrupt();
+        end += bytes;
+        left += bytes;
+        eof = bytes == 0;
+    }
+
+    if (eof) {
+        std::fill(chunk.begin() + left, chunk.end(), 0);
+        safe = end;
+    } else {
+        safe = end - DbrcTrace::MaxRecordBytes;
+    }
+    return cur < end;
+}
+
+size_t
+DbrcTraceReader::read(DbrcTraceRecord *records, size_t n)
+{
+    size_t i = 0;
+    while (i < n && next(records[i]))
+        i++;
+    return i;
+}
+
+bool
+DbrcTraceReader::isTrace(const std::string &filename)
+{
+    gzFile file = gzopen(filename.c_str(), "rb");
+    if (!file)
+        return false;
+    char magic[sizeof(DbrcTrace::Magic)];
+    bool is_trace = gzread(file, magic, sizeof(magic)) == sizeof(magic) &&
+                    memcmp(magic, DbrcTrace::Magic, sizeof(magic)) == 0;
+    gzclose(file);
+    return is_trace;
+}
+
+void
+DbrcTraceReader::corrupt() const
+{
+    throw std::runtime_error("Trace '" + filename + "' is truncated or "
+                             "corrupt");
+}
+
+DbrcTraceRecorder::DbrcTraceRecorder(const std::string &filename,
+                                     bool compress, size_t batch) :
+    batchSize(batch), writer(filename, compress, true), backFull(false),
+    done(false), written(0)
+{
+    front.reserve(batchSize);
+    back.reserve(batchSize);
+    thread = std::thread(&DbrcTraceRecorder::run, this);
+}
+
+DbrcTraceRecorder::~DbrcTraceRecorder()
+{
+    // Errors can only be reported by an explicit close()
+    try {
+        close();
+    } catch (const std::runtime_error &) {
+    }
+}
+
+bool
+DbrcTraceRecorder::handOff()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    bool stalled = backFull;
+    cond.wait(lock, [this] { return !backFull; });
+    front.swap(back);
+    front.clear();
+    backFull = true;
+    cond.notify_all();
+    return stalled;
+}
+
+void
+DbrcTraceRecorder::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cond.wait(lock, [this] { return backFull || done; });
+        if (!backFull)
+            break;
+
+        // The simulator only touches the front buffer meanwhile
+        lock.unlock();
+        try {
+            if (!error) {
+                for (const auto &record : back)
+                    writer.write(record);
+            }
+        } catch (const std::runtime_error &) {
+            error = std::current_exception();
+        }
+        lock.lock();
+
+        written += back.size();
+        backFull = false;
+        cond.notify_all();
+    }
+}
+
+void
+DbrcTraceRecorder::close()
+{
+    if (!thread.joinable())
+        return;
+
+    if (!front.empty())
+        handOff();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    cond.notify_all();
+    thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+    writer.close();
+}
+
+uint64_t
+DbrcTraceRecorder::records() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return written;
+}
@@ -0,0 +1,318 @@
+#ifndef __LEARNING_GEM5_DBRC_TRACE_HH__
+#define __LEARNING_GEM5_DBRC_TRACE_HH__
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+/// One access of a trace
+struct DbrcTraceRecord
+{
+    uint64_t addr;
+    uint32_t size;
+    uint16_t requestor;
+    bool write;
+
+    /// Only in timed traces, left at 0 otherwise
+    uint64_t tick;
+    uint8_t cmd;
+};
+
+/**
+ * Binary trace of memory accesses, replayed by the standalone trace
+ * simulator in place of the text traces of one "0x..." per line.
+ *
+ * A trace is a 16 byte header, the magic "DBRCTRC" and a NUL, the version
+ * and a word of flags, followed by the records. A record is
+ *  - a byte holding the write flag (bit 0), a requestor change flag (bit 1)
+ *    and the size (bits 2 to 7), 63 meaning that the size follows as a
+ *    varint,
+ *  - the difference with the address of the previous record, zigzag and
+ *    varint encoded,
+ *  - the requestor ID as a varint, only if it changed,
+ *  - in timed traces only, the difference with the tick of the previous
+ *    record as a varint and a byte holding the command.
+ * Streams and strides take one to three bytes per access, a few more in
+ * timed traces. The whole file may be gzip compressed.
+ *
+ * None of this depends on gem5.
+ */
+namespace DbrcTrace
+{
+
+const char Magic[8] = {'D', 'B', 'R', 'C', 'T', 'R', 'C', '\0'};
+const uint32_t Version = 1;
+const size_t HeaderBytes = 16;
+
+/// Flag of the header of timed traces
+const uint32_t Timed = 0x1;
+
+/// Largest encoded record: the flags, a 64 bit delta, the size, the
+/// requestor, the tick and the command
+const size_t MaxRecordBytes = 1 + 10 + 5 + 3 + 10 + 1;
+
+const uint8_t WriteFlag = 0x1;
+const uint8_t RequestorFlag = 0x2;
+const unsigned SizeShift = 2;
+const uint32_t SizeEscape = 0x3f;
+
+} // namespace DbrcTrace
+
+/**
+ * Writes a binary trace, buffered, gzip compressed or not.
+ */
+class DbrcTraceWriter
+{
+  public:
+    /**
+     * @param compress gzip the file, at the fastest level
+     * @param timed keep the tick and the command of the records
+     * @throw std::runtime_error if the file can't be created
+     */
+    DbrcTraceWriter(const std::string &filename, bool compress,
+                    bool timed = false);
+    ~DbrcTraceWriter();
+
+    void write(const DbrcTraceRecord &record);
+
+    /**
+     * Flush the buffer and close the file.
+     *
+     * @throw std::runtime_error if the data can't be written
+     */
+    void close();
+
+    uint64_t records() const { return count; }
+
+  private:
+    void flush();
+    void put(const void *data, size_t bytes);
+
+    const std::string filename;
+    const bool timed;
+    FILE *file;
+    gzFile gzfile;
+
+    std::vector<uint8_t> buffer;
+    size_t used;
+
+    uint64_t lastAddr;
+    uint16_t lastRequestor;
+    uint64_t lastTick;
+    uint64_t count;
+};
+
+/**
+ * Records a trace from a simulator without slowing it down much. Records
+ * are appended to a buffer. A full buffer is swapped with the one a thread
+ * is encoding and writing in the background, so the simulator only waits
+ * if the writer falls a whole buffer behind.
+ */
+class DbrcTraceRecorder
+{
+  public:
+    /**
+     * The trace is timed.
+     *
+     * @param batch number of records in each buffer
+     * @throw std::runtime_error if the file can't be created
+     */
+    DbrcTraceRecorder(const std::string &filename, bool compress,
+                      size_t batch = 1 << 16);
+    ~DbrcTraceRecorder();
+
+    DbrcTraceRecorder(const DbrcTraceRecorder &) = delete;
+    DbrcTraceRecorder &operator=(const DbrcTraceRecorder &) = delete;
+
+    /**
+     * Append a record.
+     *
+     * @return true if the buffer was full and the writer was not done with
+     *         the other one yet
+     */
+    bool
+    record(const DbrcTraceRecord &record)
+    {
+        front.push_back(record);
+        return front.size() == batchSize && handOff();
+    }
+
+    /**
+     * Write the records left and close the file. Nothing can be recorded
+     * afterwards.
+     *
+     * @throw std::runtime_error if the data can't be written
+     */
+    void close();
+
+    /// Records written so far, not counting those in the buffers
+    uint64_t records() const;
+
+  private:
+    /// Swap the buffers, waiting for the writer if needed
+    bool handOff();
+
+    /// Body of the writer thread
+    void run();
+
+    const size_t batchSize;
+    DbrcTraceWriter writer;
+
+    /// Filled by the simulator
+    std::vector<DbrcTraceRecord> front;
+
+    /// Written by the thread while backFull
+    std::vector<DbrcTraceRecord> back;
+
+    mutable std::mutex mutex;
+    std::condition_variable cond;
+    bool backFull;
+    bool done;
+    uint64_t written;
+
+    /// First error of the writer, rethrown by close()
+    std::exception_ptr error;
+
+    std::thread thread;
+};
+
+/**
+ * Reads a binary trace sequentially. A plain file is mapped in memory and
+ * the kernel is asked to read ahead of the records being decoded, so that
+ * decoding is the only cost. A gzip compressed file is inflated into a
+ * buffer, a chunk at a time.
+ */
+class DbrcTraceReader
+{
+  public:
+    /// @throw std::runtime_error if the file is not a binary trace
+    explicit DbrcTraceReader(const std::string &filename);
+    ~DbrcTraceReader();
+
+    DbrcTraceReader(const DbrcTraceReader &) = delete;
+    DbrcTraceReader &operator=(const DbrcTraceReader &) = delete;
+
+    /**
+     * Decode the next record.
+     *
+     * @return false at the end of the trace
+     * @throw std::runtime_error if the trace is truncated or corrupt
+     */
+    bool
+    next(DbrcTraceRecord &record)
+    {
+        if (cur >= safe && !refill())
+            return false;
+        decode(record);
+        if (cur > end)
+            corrupt();
+        return true;
+    }
+
+    /**
+     * Decode up to n records.
+     *
+     * @return number of records decoded, less than n at the end only
+     */
+    size_t read(DbrcTraceRecord *records, size_t n);
+
+    /// True if the records have a tick and a command
+    bool isTimed() const { return timed; }
+
+    /// True if a file starts like a binary trace, compressed or not
+    static bool isTrace(const std::string &filename);
+
+  private:
+    /// Size of the windows read ahead in a mapped file
+    static const size_t ReadAhead = 16 << 20;
+
+    /// Size of the chunks inflated from a compressed file
+    static const size_t ChunkBytes = 1 << 20;
+
+    /**
+     * Move safe past cur, or to the end of the trace. The last records are
+     * copied to the chunk, followed by zeros, so that decoding a truncated
+     * record reads no further than the padding.
+     *
+     * @return false if there are no more records
+     */
+    bool refill();
+
+    uint64_t
+    varint()
+    {
+        uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            uint8_t byte = *cur++;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+        corrupt();
+        return 0;
+    }
+
+    void
+    decode(DbrcTraceRecord &record)
+    {
+        uint8_t flags = *cur++;
+        uint64_t delta = varint();
+        lastAddr += (delta >> 1) ^ -(delta & 1);
+        uint32_t size = flags >> DbrcTrace::SizeShift;
+        if (size == DbrcTrace::SizeEscape)
+            size = varint();
+        if (flags & DbrcTrace::RequestorFlag)
+            lastRequestor = varint();
+        uint8_t cmd = 0;
+        if (timed) {
+            lastTick += varint();
+            cmd = *cur++;
+        }
+
+        record.addr = lastAddr;
+        record.size = size;
+        record.requestor = lastRequestor;
+        record.write = flags & DbrcTrace::WriteFlag;
+        record.tick = timed ? lastTick : 0;
+        record.cmd = cmd;
+    }
+
+    [[noreturn]] void corrupt() const;
+
+    const std::string filename;
+
+    /// Mapped file, null if compressed
+    uint8_t *map;
+    size_t mapBytes;
+
+    /// End of the part of the mapping asked to be read ahead
+    const uint8_t *advised;
+
+    gzFile gzfile;
+    std::vector<uint8_t> chunk;
+
+    /// No more input past end
+    bool eof;
+
+    /// Records left to decode, those before safe are decoded without
+    /// checking for the end
+    const uint8_t *cur;
+    const uint8_t *safe;
+    const uint8_t *end;
+
+    /// Timed trace
+    bool timed;
+
+    uint64_t lastAddr;
+    uint16_t lastRequestor;
+    uint64_t lastTick;
+};
+
+#endif // __LEARNING_GEM5_DBRC_TRACE_HH__
@@ -0,0 +1,85 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "dbrc_trace.hh"
+
+/**
+ * @brief Converts a text trace to a binary trace for the trace simulator.
+ *
+ * @details
+ *      Each line of the text trace is an address in hexadecimal, "0x..."
+ *      or not, optionally followed by R or W, the size in bytes and the
+ *      requestor ID. Accesses are reads of 8 bytes by requestor 0 unless
+ *      told otherwise. Empty lines and lines starting with # are skipped.
+ */
+int main(int argc, char **argv)
+{
+    bool compress = argc == 4 && strcmp(argv[1], "-z") == 0;
+    if (argc != 3 + compress) {
+        std::cerr << "Usage: " << argv[0] << " [-z] <text trace> "
+                  << "<binary trace>" << std::endl
+                  << "  -z  gzip the binary trace" << std::endl;
+        return 1;
+    }
+
+    std::ifstream text(argv[1 + compress]);
+    if (!text) {
+        std::cerr << "Can't open '" << argv[1 + compress] << "'" << std::endl;
+        return 1;
+    }
+
+    try {
+        DbrcTraceWriter trace(argv[2 + compress], compress);
+        std::string line;
+        uint64_t line_num = 0;
+
+        while (std::getline(text, line)) {
+            line_num++;
+            const char *p = line.c_str();
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if (*p == '\0' || *p == '#' || *p == '\r')
+                continue;
+
+            char *next;
+            DbrcTraceRecord record = {};
+            record.size = 8;
+            record.addr = strtoull(p, &next, 16);
+            if (next == p) {
+                std::cerr << argv[1 + compress] << ":" << line_num
+                          << ": no address" << std::endl;
+                return 1;
+            }
+            p = next;
+            while (*p == ' ' || *p == '\t')
+                p++;
+
+            if (*p == 'R' || *p == 'W' || *p == 'r' || *p == 'w') {
+                record.write = *p == 'W' || *p == 'w';
+                p++;
+                record.size = strtoul(p, &next, 0);
+                if (next == p)
+                    record.size = 8;
+                p = next;
+                record.requestor = strtoul(p, &next, 0);
+            }
+
+            trace.write(record);
+        }
+
+        trace.close();
+        printf("%lu records\n", trace.records());
+    } catch (const std::runtime_error &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,237 @@
+#ifndef __LEARNING_GEM5_DBRC_WALK_HH__
+#define __LEARNING_GEM5_DBRC_WALK_HH__
+
+#include <cassert>
+#include <cstdint>
+
+#include "dbrc_dba.hh"
+#include "dbrc_entries.hh"
+#include "dbrc_l0t.hh"
+
+/**
+ * Index arithmetic of the DBRC tree for a block size and number of BTH
+ * levels known at run time. Both must make the L0T region a power of two,
+ * so every level is a shift and a mask.
+ *
+ * An address is split, from the top, into the L0T region, one slot per BTH
+ * level below the first one and the offset in the block. Level 1 tables
+ * are found through the L0T, the table at level N > 1 through slot N of
+ * the address in the table of level N-1.
+ */
+class DbrcGeometry
+{
+  public:
+    /**
+     * The caller has to check that num_BTH is at least 1 and regionShift()
+     * is below 64.
+     */
+    DbrcGeometry(unsigned block_size, unsigned num_BTH) :
+        numLevels(num_BTH), blkBits(log2(block_size)),
+        bthBits(log2(block_size / 2)),
+        regShift(blkBits + (num_BTH ? num_BTH - 1 : 0) * bthBits)
+    {
+        assert(block_size >= 4 && (block_size & (block_size - 1)) == 0);
+    }
+
+    /// Number of BTH levels, the data blocks are at the last one
+    unsigned levels() const { return numLevels; }
+
+    /// log2 of the block size
+    unsigned blockBits() const { return blkBits; }
+
+    /// Shift from an address to its L0T region
+    unsigned regionShift() const { return regShift; }
+
+    /// Shift from an address to its slot in a table of level-1
+    unsigned slotShift(unsigned level) const
+    { return regShift - (level - 1) * bthBits; }
+
+    /// Mask of a slot, i.e. entries per table - 1
+    uint64_t slotMask() const { return (uint64_t(1) << bthBits) - 1; }
+
+    /// L0T region of an address
+    uint64_t region(uint64_t addr) const { return addr >> regionShift(); }
+
+    /// Slot of an address in the table of level-1 pointing to level
+    uint32_t
+    slot(uint64_t addr, unsigned level) const
+    {
+        return (addr >> slotShift(level)) & slotMask();
+    }
+
+  private:
+    static unsigned
+    log2(uint64_t x)
+    {
+        unsigned y = 0;
+        while (x >>= 1)
+            y++;
+        return y;
+    }
+
+    unsigned numLevels;
+    unsigned blkBits;
+    unsigned bthBits;
+    unsigned regShift;
+};
+
+/**
+ * The same arithmetic for a geometry known at compile time. Every shift and
+ * mask is a constant and walks have a fixed trip count.
+ */
+template <unsigned BlockSize, unsigned NumBTH>
+class DbrcFixedGeometry
+{
+  private:
+    static constexpr unsigned
+    log2(unsigned x)
+    {
+        return x <= 1 ? 0 : 1 + log2(x / 2);
+    }
+
+    static constexpr unsigned BthBits = log2(BlockSize / 2);
+    static constexpr unsigned RegShift =
+        log2(BlockSize) + (NumBTH - 1) * BthBits;
+
+    static_assert((BlockSize & (BlockSize - 1)) == 0,
+                  "The block size must be a power of two");
+    static_assert(NumBTH >= 1 && RegShift < 64, "Unsupported BTH levels");
+
+  public:
+    constexpr unsigned levels() const { return NumBTH; }
+    constexpr unsigned blockBits() const { return log2(BlockSize); }
+    constexpr unsigned regionShift() const { return RegShift; }
+
+    constexpr unsigned
+    slotShift(unsigned level) const
+    {
+        return RegShift - (level - 1) * BthBits;
+    }
+
+    constexpr uint64_t
+    slotMask() const
+    {
+        return (uint64_t(1) << BthBits) - 1;
+    }
+
+    uint64_t region(uint64_t addr) const { return addr >> RegShift; }
+
+    uint32_t
+    slot(uint64_t addr, unsigned level) const
+    {
+        return (addr >> slotShift(level)) & slotMask();
+    }
+};
+
+/**
+ * Walk the BTH tables down to the data block of an address, starting at a
+ * table of the path. The R counter of every table and block reached is
+ * incremented.
+ *
+ * @param tree_addr address used to index the tree
+ * @param tag tag the data block must have
+ * @param start level of the table index points to
+ * @param index table to start at, set to the last valid table or data
+ *        block
+ * @param levels if not null, incremented by the number of tables read
+ * @return true if the data block was found
+ */
+template <class Geometry>
+inline bool
+dbrcWalkFrom(const Geometry &geom, DbrcDBA &dba, uint64_t tree_addr,
+             uint64_t tag, unsigned start, uint32_t &index, unsigned *levels)
+{
+    // LNT Search
+    for (unsigned level = start + 1; level <= geom.levels(); level++) {
+        if (levels)
+            (*levels)++;
+        const BTH_entry &entry = dba.bth(index)[geom.slot(tree_addr, level)];
+        if (!entry.V)
+            return false;
+        index = entry.I;
+        DUT_entry &dut = dba.dut(index);
+        if (dut.R < 32)
+            dut.R++;
+    }
+
+    // Validate data DUT entry
+    const DUT_entry &dut = dba.dut(index);
+    return dut.LF == geom.levels() && dut.V && dba.tt(index).TAG == tag;
+}
+
+/// Index set by a walk when the L0T has no table for the region
+const uint32_t DbrcNoEntry = ~0u;
+
+/**
+ * Walk the L0T and the BTH tables down to the data block of an address.
+ * The R counter of every table and block reached below level 1 is
+ * incremented.
+ *
+ * @param tree_addr address used to index the tree
+ * @param tag tag the data block must have
+ * @param index set to the last valid table or data block, DbrcNoEntry if
+ *        none
+ * @param levels if not null, set to the number of tables read
+ * @return true if the data block was found
+ */
+template <class Geometry>
+inline bool
+dbrcWalk(const Geometry &geom, const DbrcL0T &l0t, DbrcDBA &dba,
+         uint64_t tree_addr, uint64_t tag, uint32_t &index, unsigned *levels)
+{
+    // L0T Search
+    if (levels)
+        *levels = 1;
+    const BTH_entry *root = l0t.find(geom.region(tree_addr));
+    if (!root || !root->V) {
+        index = DbrcNoEntry;
+        return false;
+    }
+    index = root->I;
+
+    return dbrcWalkFrom(geom, dba, tree_addr, tag, 1, index, levels);
+}
+
+/// A walk kernel, see dbrcWalk()
+typedef bool (*DbrcWalkFn)(const DbrcGeometry &geom, const DbrcL0T &l0t,
+                           DbrcDBA &dba, uint64_t tree_addr, uint64_t tag,
+                           uint32_t &index, unsigned *levels);
+
+/// Walk kernel specialized for one geometry, ignores geom
+template <unsigned BlockSize, unsigned NumBTH>
+bool
+dbrcWalkFixed(const DbrcGeometry &geom, const DbrcL0T &l0t, DbrcDBA &dba,
+              uint64_t tree_addr, uint64_t tag, uint32_t &index,
+              unsigned *levels)
+{
+    return dbrcWalk(DbrcFixedGeometry<BlockSize, NumBTH>(), l0t, dba,
+                    tree_addr, tag, index, levels);
+}
+
+/// Walk kernel for any geometry
+inline bool
+dbrcWalkGeneric(const DbrcGeometry &geom, const DbrcL0T &l0t, DbrcDBA &dba,
+                uint64_t tree_addr, uint64_t tag, uint32_t &index,
+                unsigned *levels)
+{
+    return dbrcWalk(geom, l0t, dba, tree_addr, tag, index, levels);
+}
+
+/**
+ * Select the walk kernel of a geometry. The common ones, 64 byte blocks
+ * with 2 to 4 BTH levels, have specialized kernels.
+ */
+inline DbrcWalkFn
+dbrcSelectWalk(const DbrcGeometry &geom)
+{
+    if (geom.blockBits() == 6) {
+        switch (geom.levels()) {
+          case 2: return &dbrcWalkFixed<64, 2>;
+          case 3: return &dbrcWalkFixed<64, 3>;
+          case 4: return &dbrcWalkFixed<64, 4>;
+        }
+    }
+    return &dbrcWalkGeneric;
+}
+
+#endif // __LEARNING_GEM5_DBRC_WALK_HH__
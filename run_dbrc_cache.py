@@ -43,12 +43,15 @@ class L2StandardCache(Cache):
         pass
 
 class L2DbrcCache(DbrcCache):
-    latency = 1
+    per_level_latency = 1
+    data_latency = 1
     size = '64kB'
     num_BTH = 3
     TLB_size = 65536
     MNA = 5
     target_BTH = 3
+    mshrs = 32
+    tgts_per_mshr = 20
     
     def __init__(self, options=None):
         super(L2DbrcCache, self).__init__()